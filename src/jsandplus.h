@@ -0,0 +1,243 @@
+/**
+ * Definitions shared by the simulator and the tools that read the grid it exports.
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include <stdint.h>
+
+#define PARTICLETYPE_ENUM_LENGTH 38
+
+enum jparticle_type_t {
+	// STILLBORN
+	JPT_NOTHING = 0,
+	JPT_WALL = 1,
+	JPT_IRONWALL = 2,
+	JPT_TORCH = 3,
+	JPT_BORDER = 4, // sentinel around the virtual screen, never drawn or updated
+	JPT_STOVE = 5,
+	JPT_ICE = 6,
+	JPT_RUST = 7,
+	JPT_EMBER = 8,
+	JPT_PLANT = 9,
+	JPT_VOID = 10,
+
+	//SPOUTS
+	JPT_WATERSPOUT = 11,
+	JPT_SANDSPOUT = 12,
+	JPT_SALTSPOUT = 13,
+	JPT_OILSPOUT = 14,
+	// ... = 15,
+
+	//ELEMENTAL
+	JPT_WATER = 16,
+	JPT_MOVEDWATER = 17,
+	JPT_DIRT = 18,
+	JPT_MOVEDDIRT = 19,
+	JPT_SALT = 20,
+	JPT_MOVEDSALT = 21,
+	JPT_OIL = 22,
+	JPT_MOVEDOIL = 23,
+	JPT_SAND = 24,
+	JPT_MOVEDSAND = 25,
+
+	//COMBINED
+	JPT_SALTWATER = 26,
+	JPT_MOVEDSALTWATER = 27,
+	JPT_MUD = 28,
+	JPT_MOVEDMUD = 29,
+	JPT_ACID = 30,
+	JPT_MOVEDACID = 31,
+
+	//FLOATING
+	JPT_STEAM = 32,
+	JPT_MOVEDSTEAM = 33,
+	JPT_FIRE = 34,
+	JPT_MOVEDFIRE = 35,
+
+	//Electricity
+	JPT_ELEC = 36,
+	JPT_MOVEDELEC = 37
+};
+
+inline std::string GetParticleName(jparticle_type_t t)
+{
+	if (t == JPT_NOTHING) {
+		return "EMPTY";
+	} else if (t == JPT_WALL) {
+		return "WALL";
+	} else if (t == JPT_IRONWALL) {
+		return "IRON WALL";
+	} else if (t == JPT_TORCH) {
+		return "TORCH";
+	} else if (t == JPT_STOVE) {
+		return "STOVE";
+	} else if (t == JPT_ICE) {
+		return "ICE";
+	} else if (t == JPT_RUST) {
+		return "RUST";
+	} else if (t == JPT_EMBER) {
+		return "EMBER";
+	} else if (t == JPT_PLANT) {
+		return "PLANT";
+	} else if (t == JPT_VOID) {
+		return "VOID";
+	} else if (t == JPT_WATERSPOUT) {
+		return "WATER SPOUT";
+	} else if (t == JPT_SANDSPOUT) {
+		return "SAND SPOUT";
+	} else if (t == JPT_SALTSPOUT) {
+		return "SALT SPOUT";
+	} else if (t == JPT_OILSPOUT) {
+		return "OIL SPOUT";
+	} else if (t == JPT_WATER) {
+		return "WATER";
+	} else if (t == JPT_MOVEDWATER) {
+		return "MOVED WATER";
+	} else if (t == JPT_DIRT) {
+		return "DIRT";
+	} else if (t == JPT_MOVEDDIRT) {
+		return "MOVED DIRT";
+	} else if (t == JPT_SALT) {
+		return "SALT";
+	} else if (t == JPT_MOVEDSALT) {
+		return "MOVED SALT";
+	} else if (t == JPT_OIL) {
+		return "OIL";
+	} else if (t == JPT_MOVEDOIL) {
+		return "MOVED OIL";
+	} else if (t == JPT_SAND) {
+		return "SAND";
+	} else if (t == JPT_MOVEDSAND) {
+		return "MOVED SAND";
+	} else if (t == JPT_SALTWATER) {
+		return "SALT WATER";
+	} else if (t == JPT_MOVEDSALTWATER) {
+		return "MOVED SALT WATER";
+	} else if (t == JPT_MUD) {
+		return "MUD";
+	} else if (t == JPT_MOVEDMUD) {
+		return "MOVED MUD";
+	} else if (t == JPT_ACID) {
+		return "ACID";
+	} else if (t == JPT_MOVEDACID) {
+		return "MOVED ACID";
+	} else if (t == JPT_STEAM) {
+		return "STEAM";
+	} else if (t == JPT_MOVEDSTEAM) {
+		return "MOVED STEAM";
+	} else if (t == JPT_FIRE) {
+		return "FIRE";
+	} else if (t == JPT_MOVEDFIRE) {
+		return "MOVED FIRE";
+	} else if (t == JPT_ELEC) {
+		return "ELECTRICITY";
+	} else if (t == JPT_MOVEDELEC) {
+		return "MOVED ELECTRICITY";
+	}
+
+	return "";
+}
+
+// Default name of the POSIX shared memory segment exported with --shm
+#define SHARED_GRID_NAME "/jsandplus"
+#define SHARED_GRID_MAGIC 0x4a534e44
+#define SHARED_GRID_VERSION 1
+
+// Header of the exported segment. The cells follow the header as a row-major array of
+// width*height particle types (int32). The simulator makes the sequence odd while it publishes a
+// frame, so a reader must retry when the sequence was odd or changed while it looked at the cells
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	std::atomic<uint64_t> sequence;
+	uint64_t tick;
+	uint8_t reserved[32];
+} jshared_grid_t;
+
+static_assert(sizeof(jshared_grid_t) == 64, "the cells must start at a cache line");
+static_assert(sizeof(jparticle_type_t) == sizeof(int32_t), "the cells are exported as int32");
+
+// Default path of the Unix domain socket of the control server, started with --control
+#define CONTROL_SOCKET_PATH "/tmp/jsandplus.sock"
+
+// Commands of the control protocol. Every message, in both directions, is a jcontrol_header_t
+// followed by 'length' bytes of payload, in the byte order of the host. The commands that arrive
+// during a tick are run together at the start of the next one; only STEP, STATS and FRAMES reply,
+// with the opcode of the command, and a malformed command is answered with JCO_ERROR
+enum jcontrol_opcode_t {
+	JCO_STROKE = 1, // jcontrol_stroke_t: a line of circles from (x0, y0) to (x1, y1)
+	JCO_STAMP = 2, // jcontrol_stroke_t: a circle at (x0, y0)
+	JCO_MATERIAL = 3, // uint8_t: selects the particle type of the dashboard
+	JCO_EMITTER = 4, // jcontrol_emitter_t: switches and adjusts an emitter of the top
+	JCO_STEP = 5, // uint32_t: pauses and runs that many ticks, replies with the tick (uint64_t)
+	JCO_PAUSE = 6, // uint8_t: pauses (1) or resumes (0) the simulation
+	JCO_STATS = 7, // no payload, replies with a jcontrol_stats_t
+	JCO_FRAMES = 8, // jcontrol_frames_t: streams jcontrol_frame_t replies, an interval of 0 stops
+	JCO_FILL = 9, // jcontrol_region_t: fills the region with the particle type 'value'
+	JCO_COPY = 10, // jcontrol_region_t: copies the region to the clipboard of the simulator
+	JCO_PASTE = 11, // jcontrol_region_t: pastes the clipboard with its top left corner at (x, y)
+	JCO_PREFAB = 12, // jcontrol_region_t: stamps the prefab number 'value' centered at (x, y)
+	JCO_ERROR = 255
+};
+
+typedef struct {
+	uint8_t opcode;
+	uint8_t status; // 0, reserved
+	uint16_t reserved;
+	uint32_t length;
+} jcontrol_header_t;
+
+typedef struct {
+	int16_t x0;
+	int16_t y0;
+	int16_t x1;
+	int16_t y1;
+	uint8_t radius;
+	uint8_t type;
+	uint8_t reserved[2];
+} jcontrol_stroke_t;
+
+typedef struct {
+	uint8_t emitter; // 0 water, 1 sand, 2 salt, 3 oil
+	uint8_t enabled;
+	uint8_t density; // percent, 0 keeps the current density
+	uint8_t reserved;
+} jcontrol_emitter_t;
+
+typedef struct {
+	int16_t x;
+	int16_t y;
+	int16_t width;
+	int16_t height;
+	uint8_t value;
+	uint8_t reserved[3];
+} jcontrol_region_t;
+
+// The moved particles are counted with their particle
+typedef struct {
+	uint64_t tick;
+	uint64_t particles;
+	uint32_t counts[PARTICLETYPE_ENUM_LENGTH];
+} jcontrol_stats_t;
+
+typedef struct {
+	uint16_t scale; // each pixel of the frame samples a scale x scale block of cells
+	uint16_t reserved;
+	uint32_t interval; // ticks between frames
+} jcontrol_frames_t;
+
+// A streamed frame is this header and width*height particle types, one byte each
+typedef struct {
+	uint64_t tick;
+	uint16_t width;
+	uint16_t height;
+	uint32_t reserved;
+} jcontrol_frame_t;
+
+static_assert(sizeof(jcontrol_header_t) == 8 && sizeof(jcontrol_stroke_t) == 12 && sizeof(jcontrol_region_t) == 12 && sizeof(jcontrol_frame_t) == 16, "packed messages");
@@ -6,846 +6,5351 @@
 #include "jcanvas/core/jwindow.h"
 #include "jcanvas/core/jenum.h"
 
+#include "jsandplus.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 
+#include <immintrin.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #define STILLBORN_UPPER_BOUND 14
 #define STILLBORN_LOWER_BOUND 1
 #define FLOATING_UPPER_BOUND 35
 #define FLOATING_LOWER_BOUND 32
-#define PARTICLETYPE_ENUM_LENGTH 38
+
+// Reactivity classes of the stillborn particles (see Screen::SetParticle)
+#define REACTIVE_ALWAYS 0x01
+#define REACTIVE_NEAR_WATER 0x02
+#define REACTIVE_NEAR_RUST 0x04
+#define TRIGGERS_NEAR_WATER 0x08
+#define TRIGGERS_NEAR_RUST 0x10
+
+// Heat field (arbitrary units)
+#define HEAT_AMBIENT 20.0f
+#define HEAT_DIFFUSION 0.2f
+#define HEAT_COOLING 0.02f
+#define HEAT_ICE -40.0f
+#define HEAT_ICE_MELTING 0.0f
+#define HEAT_WATER_BOILING 100.0f
+#define HEAT_OIL_IGNITION 150.0f
+
+// Number of ticks a network stays energized after a spark
+#define ELEC_DURATION 8
+
+// Maximum number of ticks the frame budgeted scheduler tries to catch up
+#define MAXIMUM_LAG 4.0f
+
+// Margolus neighbourhood: 4 cells of 5 classes per block
+#define MARGOLUS_STATES 625
+#define MARGOLUS_IDENTITY 0xe4
 
 #define BUTTON_COUNT 19
 #define BUTTON_SIZE 24
 #define BUTTON_GAP 4
 #define DASHBOARD_SIZE (BUTTON_SIZE + 4)
 
-enum jparticle_type_t {
-	// STILLBORN
-	JPT_NOTHING = 0,
-	JPT_WALL = 1,
-	JPT_IRONWALL = 2,
-	JPT_TORCH = 3,
-	// ... = 4,
-	JPT_STOVE = 5,
-	JPT_ICE = 6,
-	JPT_RUST = 7,
-	JPT_EMBER = 8,
-	JPT_PLANT = 9,
-	JPT_VOID = 10,
-
-	//SPOUTS
-	JPT_WATERSPOUT = 11,
-	JPT_SANDSPOUT = 12,
-	JPT_SALTSPOUT = 13,
-	JPT_OILSPOUT = 14,
-	// ... = 15,
-
-	//ELEMENTAL
-	JPT_WATER = 16,
-	JPT_MOVEDWATER = 17,
-	JPT_DIRT = 18,
-	JPT_MOVEDDIRT = 19,
-	JPT_SALT = 20,
-	JPT_MOVEDSALT = 21,
-	JPT_OIL = 22,
-	JPT_MOVEDOIL = 23,
-	JPT_SAND = 24,
-	JPT_MOVEDSAND = 25,
-
-	//COMBINED
-	JPT_SALTWATER = 26,
-	JPT_MOVEDSALTWATER = 27,
-	JPT_MUD = 28,
-	JPT_MOVEDMUD = 29,
-	JPT_ACID = 30,
-	JPT_MOVEDACID = 31,
-
-	//FLOATING
-	JPT_STEAM = 32,
-	JPT_MOVEDSTEAM = 33,
-	JPT_FIRE = 34,
-	JPT_MOVEDFIRE = 35,
-
-	//Electricity
-	JPT_ELEC = 36,
-	JPT_MOVEDELEC = 37
+// Rows and columns of sentinels around the virtual screen, and the alignment of its rows
+#define GRID_PADDING 1
+#define GRID_ALIGNMENT 64
+
+// With JSAND_TILED_LAYOUT the virtual screen is stored in square tiles of GRID_TILE cells per side
+// instead of row by row, so the rows above and below a cell are in the same few cache lines
+#define GRID_TILE 16
+
+// The render tracks the damage of the virtual screen in granules of 2^DAMAGE_SHIFT cell indexes
+#define DAMAGE_SHIFT 6
+
+// The undo history saves the cells written by an edit in chunks of 2^HISTORY_CHUNK_SHIFT cell indexes,
+// and forgets the oldest edits beyond HISTORY_BUDGET bytes
+#define HISTORY_CHUNK_SHIFT 10
+#define HISTORY_BUDGET (64 << 20)
+
+// Frames of the capture that can be queued or encoded at the same time
+#define CAPTURE_FRAMES 8
+
+// The checkpoints are saved every CHECKPOINT_INTERVAL ticks by default, and only the newest
+// CHECKPOINT_KEEP files are kept
+#define CHECKPOINT_MAGIC 0x4a434b50
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_INTERVAL 3600
+#define CHECKPOINT_KEEP 3
+
+// The control server drops the clients that send a payload larger than CONTROL_MAXIMUM_PAYLOAD or
+// leave more than CONTROL_MAXIMUM_PENDING bytes of replies unread. CONTROL_CLOSED is queued when a
+// client goes away
+#define CONTROL_MAXIMUM_PAYLOAD 4096
+#define CONTROL_MAXIMUM_PENDING (4 << 20)
+#define CONTROL_CLOSED 0
+
+// The fast particles fly apart from the grid: they are pulled by FAST_GRAVITY cells/tick^2 (the
+// floating ones are pushed up by half of it), lose FAST_DRAG of their speed per tick and are put back
+// in the grid when they hit something or slow down below FAST_REST cells/tick
+#define FAST_GRAVITY 0.3f
+#define FAST_DRAG 0.02f
+#define FAST_REST 0.75f
+#define FAST_MAXIMUM_SPEED 16.0f
+#define FAST_LIMIT 65536
+#define FAST_BURST 96
+
+// Streams of the random decisions of a cell, so two decisions about the same cell in a tick never
+// draw the same numbers
+#define RANDOM_MOVE 0
+#define RANDOM_STILLBORN 1
+#define RANDOM_SWEEP 2
+#define RANDOM_EMIT 3
+#define RANDOM_MARGOLUS 4
+#define RANDOM_LIFETIME 5
+#define RANDOM_DECAY 6
+
+// The timing wheel has WHEEL_LEVELS levels of 2^WHEEL_BITS slots, so it schedules up to 2^24 ticks
+// ahead; the timers due later wait in the last slot of the outer level and are scheduled again
+#define WHEEL_BITS 8
+#define WHEEL_LEVELS 3
+
+// Auxiliary layers of two bytes per cell, allocated while a material that uses them is on the screen.
+// The lifetime layer counts down the updates left to the fire, ember and steam cells
+#define LAYER_LIFETIME 0
+#define LAYER_COUNT 1
+
+// Largest prefab that can be loaded, in cells per side
+#define PREFAB_MAXIMUM_SIZE 256
+
+// The cost overlay counts the cells updated in square tiles of COST_TILE pixels per side, and lists
+// the COST_TOP hottest ones
+#define COST_TILE 16
+#define COST_TOP 4
+
+// The overview is a pyramid of MIP_LEVELS levels, where a block of the level k (0 based) holds the
+// dominant material of 2^(k+1) cells per side, so the first level already halves the screen. The
+// pyramid is rebuilt in tiles of 2^MIP_LEVELS cells per side, and shown in an inset of
+// OVERVIEW_WIDTH x OVERVIEW_HEIGHT pixels
+#define MIP_LEVELS 4
+#define OVERVIEW_WIDTH 180
+#define OVERVIEW_HEIGHT 120
+
+// The reaction panel lists the REACTION_TOP most frequent pairs of materials
+#define REACTION_TOP 6
+
+enum jsimulation_engine_t {
+	JSE_CELLULAR = 0, // scanline engine driven by the move kernels
+	JSE_MARGOLUS = 1 // 2x2 block engine with alternating offsets
+};
+
+// Classes of the Margolus rule table, ordered by density
+enum jmargolus_class_t {
+	JMC_GAS = 0,
+	JMC_EMPTY = 1,
+	JMC_LIQUID = 2,
+	JMC_POWDER = 3,
+	JMC_SOLID = 4
+};
+
+// The kernels that stream whole rows, and the sweep of the cells (see Screen::UpdateCellularScreen()),
+// are compiled for several instruction sets and the one the cpu supports is chosen at startup, see
+// SelectKernels(). The generic variant only needs SSE2, which every x86-64 has; the others also use
+// the bit manipulation instructions that come with them to scan the bitsets
+enum jisa_t {
+	JISA_GENERIC,
+	JISA_AVX2,
+	JISA_AVX512,
+	JISA_LENGTH
 };
 
-// Button rectangle struct
 typedef struct {
-	jcanvas::jrect_t<int> rect;
-	jparticle_type_t particleType;
-} jbutton_rect_t;
+	jisa_t isa;
+	const char *name;
+	void (*diffuse_row)(float *out, const float *above, const float *same, const float *below, int width);
+	void (*paint_row)(uint32_t *pixels, const jparticle_type_t *cells, int length, const uint32_t *palette);
+} jkernels_t;
+
+// A row of the heat grid, N cells at a time (see Screen::DiffuseHeat()). The N lanes of floats are
+// lowered by the compiler to the SIMD registers of the variant
+template <int N>
+static inline __attribute__((always_inline)) void DiffuseRowKernel(float *__restrict out, const float *__restrict above, const float *__restrict same, const float *__restrict below, int width)
+{
+	typedef float jfloatn_t __attribute__((vector_size(4*N)));
 
-class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanvas::MouseListener {
+	int x = 0;
+
+	for (; x+N<=width; x+=N) {
+		jfloatn_t c, up, down, left, right;
+
+		memcpy(&c, same + x, sizeof(c));
+		memcpy(&up, above + x, sizeof(up));
+		memcpy(&down, below + x, sizeof(down));
+		memcpy(&left, same + x - 1, sizeof(left));
+		memcpy(&right, same + x + 1, sizeof(right));
+
+		jfloatn_t t = c + HEAT_DIFFUSION*(up + down + left + right - 4.0f*c);
+
+		t = t + HEAT_COOLING*(HEAT_AMBIENT - t);
+
+		memcpy(out + x, &t, sizeof(t));
+	}
+
+	for (; x<width; x++) {
+		float c = same[x];
+		float t = c + HEAT_DIFFUSION*(above[x] + below[x] + same[x - 1] + same[x + 1] - 4.0f*c);
+
+		out[x] = t + HEAT_COOLING*(HEAT_AMBIENT - t);
+	}
+}
+
+static void DiffuseRowGeneric(float *out, const float *above, const float *same, const float *below, int width)
+{
+	DiffuseRowKernel<4>(out, above, same, below, width);
+}
+
+__attribute__((target("avx2"))) static void DiffuseRowAvx2(float *out, const float *above, const float *same, const float *below, int width)
+{
+	DiffuseRowKernel<8>(out, above, same, below, width);
+}
+
+__attribute__((target("avx512f"))) static void DiffuseRowAvx512(float *out, const float *above, const float *same, const float *below, int width)
+{
+	DiffuseRowKernel<16>(out, above, same, below, width);
+}
+
+// The colors of a run of cells
+static void PaintRowGeneric(uint32_t *pixels, const jparticle_type_t *cells, int length, const uint32_t *palette)
+{
+	for (int i=0; i<length; i++) {
+		pixels[i] = palette[cells[i]];
+	}
+}
+
+__attribute__((target("avx2"))) static void PaintRowAvx2(uint32_t *pixels, const jparticle_type_t *cells, int length, const uint32_t *palette)
+{
+	int i = 0;
+
+	for (; i+8<=length; i+=8) {
+		__m256i types = _mm256_loadu_si256((const __m256i *)(cells + i));
+
+		_mm256_storeu_si256((__m256i *)(pixels + i), _mm256_i32gather_epi32((const int *)palette, types, 4));
+	}
+
+	for (; i<length; i++) {
+		pixels[i] = palette[cells[i]];
+	}
+}
+
+__attribute__((target("avx512f"))) static void PaintRowAvx512(uint32_t *pixels, const jparticle_type_t *cells, int length, const uint32_t *palette)
+{
+	int i = 0;
+
+	for (; i+16<=length; i+=16) {
+		__m512i types = _mm512_loadu_si512((const void *)(cells + i));
+
+		_mm512_storeu_si512((void *)(pixels + i), _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xffff, types, (const void *)palette, 4));
+	}
+
+	for (; i<length; i++) {
+		pixels[i] = palette[cells[i]];
+	}
+}
+
+static const jkernels_t isa_kernels[JISA_LENGTH] = {
+	{JISA_GENERIC, "generic", DiffuseRowGeneric, PaintRowGeneric},
+	{JISA_AVX2, "avx2", DiffuseRowAvx2, PaintRowAvx2},
+	{JISA_AVX512, "avx512", DiffuseRowAvx512, PaintRowAvx512}
+};
+
+static bool IsSupported(jisa_t isa)
+{
+	__builtin_cpu_init();
+
+	bool bits = __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("lzcnt");
+
+	switch (isa) {
+		case JISA_AVX2:
+			return bits && __builtin_cpu_supports("avx2");
+		case JISA_AVX512:
+			return bits && __builtin_cpu_supports("avx512f");
+		default:
+			return true;
+	}
+}
+
+// The kernels of the named instruction set, or of the best one the cpu supports when 'name' is empty.
+// Returns nullptr when the cpu doesn't support the named one
+static const jkernels_t * SelectKernels(std::string name)
+{
+	for (int i=JISA_LENGTH; i--;) {
+		if ((name.empty() == true || name == isa_kernels[i].name) && IsSupported((jisa_t)i) == true) {
+			return &isa_kernels[i];
+		}
+	}
+
+	return nullptr;
+}
+
+static const jkernels_t *kernels = SelectKernels("");
+
+// Two level bitset over the cell indexes of the virtual screen. The summary level holds one bit
+// per 64-bit word, so the sweeps jump over empty words (and whole empty rows) without loading them
+class BitGrid {
 
 	private:
-		jparticle_type_t *_vs;
-		jparticle_type_t _current_particle;
-		jcanvas::jrect_t<int> _scene;
-		jbutton_rect_t _buttons[BUTTON_COUNT];
-		float _water_density;
-		float _sand_density;
-		float _salt_density;
-		float _oil_density;
-		int _slow;
-		int _upper_row_y;
-		int _middle_row_y;
-		int _lower_row_y;
-		int _particle_count;
-		int _pen_size;
-		int _old_x;
-		int _old_y;
-		int _mb_x;
-		int _mb_y;
-		int _can_move_x;
-		int _can_move_y;
-		int _speed_x;
-		int _speed_y;
-		bool _is_button_down;
-		bool _emit_water;
-		bool _emit_sand;
-		bool _emit_salt;
-		bool _emit_oil;
-		bool _implement_particle_swaps;
+		std::vector<uint64_t> _bits;
+		std::vector<uint64_t> _summary;
 
 	public:
-		Screen():
-			jcanvas::Window({720, 480})
+		BitGrid(int length):
+			_bits((length + 63)/64 + 1, 0),
+			_summary((_bits.size() + 63)/64, 0)
 		{
-      jcanvas::jpoint_t<int>
-        size = GetSize();
+		}
 
-			_vs = new jparticle_type_t[size.x*size.y];
+		inline void Set(int index)
+		{
+			int w = index >> 6;
 
-			_water_density = 0.3f;
-			_sand_density = 0.3f;
-			_salt_density = 0.3f;
-			_oil_density = 0.3f;
+			_bits[w] |= 1ull << (index & 63);
+			_summary[w >> 6] |= 1ull << (w & 63);
+		}
 
-			_emit_water = true;
-			_emit_sand = true;
-			_emit_salt = true;
-			_emit_oil = true;
+		inline void Reset(int index)
+		{
+			int w = index >> 6;
 
-			_can_move_x = 0;
-			_can_move_y = 0;
-			_mb_x = 0;
-			_mb_y = 0;
-			_old_x = size.x/2;
-			_old_y = size.y/2;
-			_is_button_down = false;
+			_bits[w] &= ~(1ull << (index & 63));
 
-			_particle_count = 0;
-			_pen_size = 2;
-			_slow = false;
-			_speed_x = 0;
-			_speed_y = 0;
-			_current_particle = JPT_WALL;
+			if (_bits[w] == 0) {
+				_summary[w >> 6] &= ~(1ull << (w & 63));
+			}
+		}
 
-			_implement_particle_swaps = true;
+		inline bool Test(int index)
+		{
+			return (_bits[index >> 6] >> (index & 63)) & 1;
+		}
 
-			_upper_row_y = size.y - BUTTON_SIZE - 1;
-			_middle_row_y = size.y - BUTTON_SIZE - 1;
-			_lower_row_y = size.y - BUTTON_SIZE - 1;
+		void Clear()
+		{
+			std::fill(_bits.begin(), _bits.end(), 0);
+			std::fill(_summary.begin(), _summary.end(), 0);
+		}
 
-			init();
-			Clear();
+		// Returns the first set bit in [from, to) or -1
+		inline int Next(int from, int to)
+		{
+			if (from >= to) {
+				return -1;
+			}
+
+			int w = from >> 6;
+			int last = (to - 1) >> 6;
+			uint64_t word = _bits[w] & (~0ull << (from & 63));
+
+			while (word == 0) {
+				// find the next non-empty word through the summary
+				w = w + 1;
+
+				if (w > last) {
+					return -1;
+				}
+
+				uint64_t summary = _summary[w >> 6] & (~0ull << (w & 63));
+
+				while (summary == 0) {
+					w = (w | 63) + 1;
+
+					if (w > last) {
+						return -1;
+					}
+
+					summary = _summary[w >> 6];
+				}
+
+				w = (w & ~63) + __builtin_ctzll(summary);
+
+				if (w > last) {
+					return -1;
+				}
+
+				word = _bits[w];
+			}
+
+			int index = (w << 6) + __builtin_ctzll(word);
+
+			return (index < to)?index:-1;
 		}
 
-		virtual ~Screen()
+		// Returns the last set bit in [from, to) or -1
+		inline int Previous(int from, int to)
 		{
+			if (from >= to) {
+				return -1;
+			}
+
+			int w = (to - 1) >> 6;
+			int first = from >> 6;
+			uint64_t word = _bits[w] & (~0ull >> (63 - ((to - 1) & 63)));
+
+			while (word == 0) {
+				w = w - 1;
+
+				if (w < first) {
+					return -1;
+				}
+
+				uint64_t summary = _summary[w >> 6] & (~0ull >> (63 - (w & 63)));
+
+				while (summary == 0) {
+					w = (w & ~63) - 1;
+
+					if (w < first) {
+						return -1;
+					}
+
+					summary = _summary[w >> 6];
+				}
+
+				w = (w & ~63) + 63 - __builtin_clzll(summary);
+
+				if (w < first) {
+					return -1;
+				}
+
+				word = _bits[w];
+			}
+
+			int index = (w << 6) + 63 - __builtin_clzll(word);
+
+			return (index >= from)?index:-1;
 		}
 
-		//Checks wether a given particle type is a stillborn element
-		bool IsStillborn(jparticle_type_t t)
+		// Checks wether there is any set bit in [from, to)
+		inline bool Any(int from, int to)
 		{
-			return (t >= STILLBORN_LOWER_BOUND && t <= STILLBORN_UPPER_BOUND);
+			return Next(from, to) >= 0;
 		}
+};
 
-		//Checks wether a given particle type is a floting type - like FIRE and STEAM
-		bool IsFloating(jparticle_type_t t)
+// A timer of the timing wheel: the cell whose transition is due at the tick 'due'
+typedef struct {
+	int index;
+	uint64_t due;
+} jtimer_t;
+
+// Hierarchical timing wheel of the transitions of the cells. A timer is put in the inner level when
+// it is due in less than 2^WHEEL_BITS ticks, otherwise in the slot of an outer level, whose timers
+// are cascaded to the inner levels when the wheel reaches it. Only the timers that are due are
+// visited at each tick
+class TimingWheel {
+
+	private:
+		std::vector<jtimer_t> _slots[WHEEL_LEVELS][1 << WHEEL_BITS];
+		std::vector<jtimer_t> _due;
+		uint64_t _now;
+
+	private:
+		void Insert(jtimer_t timer)
 		{
-			return (t >= FLOATING_LOWER_BOUND && t <= FLOATING_UPPER_BOUND);
+			uint64_t due = std::min<uint64_t>(timer.due, _now + (1ull << (WHEEL_BITS*WHEEL_LEVELS)) - 1);
+
+			for (int level=0; level<WHEEL_LEVELS; level++) {
+				if (due - _now < (1ull << (WHEEL_BITS*(level + 1))) || level == WHEEL_LEVELS - 1) {
+					_slots[level][(due >> (WHEEL_BITS*level)) & ((1 << WHEEL_BITS) - 1)].push_back(timer);
+
+					return;
+				}
+			}
 		}
 
-		//Checks wether a given particle type is burnable - like JPT_PLANT and OIL
-		bool IsBurnable(jparticle_type_t t)
+	public:
+		TimingWheel():
+			_now(0)
 		{
-			return (t == JPT_PLANT || t == JPT_OIL || t == JPT_MOVEDOIL);
 		}
 
-		//Checks wether a given particle type is burnable - like JPT_PLANT and OIL
-		bool BurnsAsEmber(jparticle_type_t t)
+		// Dropping every timer and starting over at 'now'
+		void Reset(uint64_t now)
 		{
-			return (t == JPT_PLANT); //Maybe we'll add a FUSE or WOOD
+			for (int level=0; level<WHEEL_LEVELS; level++) {
+				for (auto &slot : _slots[level]) {
+					slot.clear();
+				}
+			}
+
+			_now = now;
 		}
 
-		uint32_t colors[PARTICLETYPE_ENUM_LENGTH];
+		// Scheduling a timer for a tick after the current one
+		void Schedule(int index, uint64_t due)
+		{
+			Insert({index, std::max(due, _now + 1)});
+		}
 
-		// Initializing colors
-		void initColors()
+		// Advancing the wheel to 'tick' and calling fn(timer) for the timers that are due
+		template <typename F>
+		void Advance(uint64_t tick, F fn)
 		{
-			//STILLBORN
-			colors[JPT_SAND] = 0xffeecc80;
-			colors[JPT_WALL] = 0xff646464;
-			colors[JPT_VOID] = 0xff3c3c3c;
-			colors[JPT_IRONWALL] = 0xff6e6e6e;
-			colors[JPT_TORCH] = 0xff8b4520;
-			colors[JPT_STOVE] = 0xff4a4a4a;
-			colors[JPT_ICE] = 0xffafeeee;
-			colors[JPT_PLANT] = 0xff009600;
-			colors[JPT_EMBER] = 0xff7f2020;
-			colors[JPT_RUST] = 0xff6e280a;
+			while (_now < tick) {
+				_now++;
 
-			//ELEMENTAL
-			colors[JPT_WATER] = 0xff2020ff;
-			colors[JPT_DIRT] = 0xffcdaf96;
-			colors[JPT_SALT] = 0xffffffff;
-			colors[JPT_OIL] = 0xff804040;
+				// the outer levels go first, so a timer cascades down to the inner level in one go
+				for (int level=WHEEL_LEVELS-1; level>0; level--) {
+					if ((_now & ((1ull << (WHEEL_BITS*level)) - 1)) != 0) {
+						continue;
+					}
 
-			//COMBINED
-			colors[JPT_MUD] = 0xff8b4515;
-			colors[JPT_SALTWATER] = 0xff4070e0;
-			colors[JPT_STEAM] = 0xff5f9ea0;
+					std::vector<jtimer_t> &slot = _slots[level][(_now >> (WHEEL_BITS*level)) & ((1 << WHEEL_BITS) - 1)];
 
-			//EXTRA
-			colors[JPT_ACID] = 0xffadff2f;
-			colors[JPT_FIRE] = 0xffff3232;
-			colors[JPT_ELEC] = 0xffffff00;
+					_due.swap(slot);
 
-			//SPOUTS
-			colors[JPT_WATERSPOUT] = 0xff000080;
-			colors[JPT_SANDSPOUT] = 0xfff0e68c;
-			colors[JPT_SALTSPOUT] = 0xffeeeaea;
-			colors[JPT_OILSPOUT] = 0xff6c2c2c;
+					for (jtimer_t &timer : _due) {
+						Insert(timer);
+					}
+
+					_due.clear();
+				}
+
+				std::vector<jtimer_t> &slot = _slots[0][_now & ((1 << WHEEL_BITS) - 1)];
+
+				if (slot.empty() == true) {
+					continue;
+				}
+
+				_due.swap(slot);
+
+				for (jtimer_t &timer : _due) {
+					if (timer.due <= _now) {
+						fn(timer);
+					} else {
+						Insert(timer);
+					}
+				}
+
+				_due.clear();
+			}
 		}
+};
 
-		// Emitting a given particletype at (x,o) width pixels wide and
-		// with a p density (probability that a given pixel will be drawn 
-		// at a given position withing the width)
-		void Emit(int x, int width, jparticle_type_t type, float p)
-		{
-      jcanvas::jpoint_t<int>
-        size = GetSize();
+// Stateless random numbers (splitmix64 finalizer)
+static inline uint64_t Hash(uint64_t z)
+{
+	z = (z + 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27))*0x94d049bb133111ebull;
 
-			for (int i=x-width/2; i<x+width/2; i++) {
-				if (rand() < (int)(RAND_MAX * p)) {
-					_vs[i + size.x] = type;
+	return z ^ (z >> 31);
+}
+
+// Counter based generator of the random decisions of a cell. The n-th number drawn for a cell in a
+// tick only depends on the seed of the world, the tick, the position of the cell, the stream of the
+// decision and n, so the decisions don't depend on the order the cells are visited, on the layout
+// of the grid or on the threads that update it
+class CellRandom {
+
+	private:
+		uint64_t _key;
+		uint64_t _counter;
+
+	public:
+		CellRandom(uint64_t seed, uint64_t tick, int x, int y, int stream):
+			_key(Hash(Hash(seed ^ (tick << 8) ^ stream) ^ ((uint64_t)(uint32_t)y << 32) ^ (uint32_t)x)),
+			_counter(0)
+		{
+		}
+
+		inline uint64_t Next()
+		{
+			return Hash(_key + 0x9e3779b97f4a7c15ull*(_counter++));
+		}
+
+		// Uniform in [0, 1)
+		inline float NextFloat()
+		{
+			return (Next() >> 40)*(1.0f/16777216.0f);
+		}
+};
+
+// Compile time traits of the materials updated by the move kernels, given by their MOVED type
+template <jparticle_type_t T>
+struct jparticle_traits_t {
+	static constexpr bool floating = (T >= FLOATING_LOWER_BOUND && T <= FLOATING_UPPER_BOUND);
+	static constexpr bool swaps = (T == JPT_MOVEDWATER || T == JPT_MOVEDOIL || T == JPT_MOVEDSALTWATER);
+};
+
+// Button rectangle struct
+typedef struct {
+	jcanvas::jrect_t<int> rect;
+	jparticle_type_t particleType;
+} jbutton_rect_t;
+
+// An edit of the undo history: the chunks it touched, and for their cells, one chunk after the other,
+// the type before the edit wrote the cell and the type the edit left there. JPT_BORDER marks the cells
+// the edit didn't write
+typedef struct {
+	std::vector<int> chunks;
+	std::vector<jparticle_type_t> cells;
+	std::vector<jparticle_type_t> edited;
+} jhistory_entry_t;
+
+// Pattern of cells pasted by the region primitives, row by row. JPT_BORDER marks the transparent
+// cells, which keep what is below them
+typedef struct {
+	std::string name;
+	int width;
+	int height;
+	std::vector<jparticle_type_t> cells;
+} jprefab_t;
+
+// Particle in flight, with sub-cell position and velocity in cells per tick
+typedef struct {
+	float x;
+	float y;
+	float vx;
+	float vy;
+	jparticle_type_t type;
+} jfast_particle_t;
+
+// What a band of the Margolus engine reports of a phase: the cells that changed, with the type they
+// had, and with JSAND_REACTION_COUNTERS the particles that decayed, by material
+typedef struct {
+	std::vector<std::pair<int, jparticle_type_t>> changes;
+#ifdef JSAND_REACTION_COUNTERS
+	std::array<uint32_t, PARTICLETYPE_ENUM_LENGTH> decays;
+#endif
+} jmargolus_band_t;
+
+// Frame of the capture: the particle types of the screen, one byte per cell
+typedef struct {
+	uint64_t tick;
+	std::vector<uint8_t> cells;
+} jcapture_frame_t;
+
+// Recording the screen to a PNG sequence or to a Y4M stream. The simulation only copies the grid
+// to a pooled frame; the palette expansion, the encoding and the disk I/O run on worker threads.
+// When every frame of the pool is in use the new frame is dropped instead of waiting
+class FrameCapture {
+
+	private:
+		std::string _target;
+		bool _y4m;
+		int _width;
+		int _height;
+		uint32_t _palette[256];
+		FILE *_stream;
+		std::deque<jcapture_frame_t> _queue;
+		std::vector<jcapture_frame_t> _pool;
+		int _allocated;
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::vector<std::thread> _workers;
+		bool _running;
+		std::atomic<uint64_t> _written;
+		std::atomic<uint64_t> _dropped;
+
+		static uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t length)
+		{
+			// the writers encode on several threads, so the table is built once by the initialization
+			// of the static, which is thread safe
+			static const std::array<uint32_t, 256> table = []() {
+				std::array<uint32_t, 256> table;
+
+				for (uint32_t n=0; n<256; n++) {
+					uint32_t c = n;
+
+					for (int k=0; k<8; k++) {
+						c = (c & 1)?(0xedb88320u ^ (c >> 1)):(c >> 1);
+					}
+
+					table[n] = c;
+				}
+
+				return table;
+			}();
+
+			crc = ~crc;
+
+			for (size_t i=0; i<length; i++) {
+				crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+			}
+
+			return ~crc;
+		}
+
+		static void PutUInt32(std::vector<uint8_t> &out, uint32_t value)
+		{
+			out.push_back(value >> 24);
+			out.push_back(value >> 16);
+			out.push_back(value >> 8);
+			out.push_back(value);
+		}
+
+		static void PutChunk(std::vector<uint8_t> &out, const char *type, const std::vector<uint8_t> &data)
+		{
+			size_t start = out.size() + 4;
+
+			PutUInt32(out, data.size());
+			out.insert(out.end(), type, type + 4);
+			out.insert(out.end(), data.begin(), data.end());
+			PutUInt32(out, Crc32(0, out.data() + start, out.size() - start));
+		}
+
+		// Encoding a frame as an indexed PNG. The image data is stored with uncompressed deflate
+		// blocks, which keeps the encoder small and fast; the files are about one byte per cell
+		void EncodePNG(const jcapture_frame_t &frame, std::vector<uint8_t> &out, std::vector<uint8_t> &data)
+		{
+			static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+			out.assign(signature, signature + 8);
+
+			data.clear();
+			PutUInt32(data, _width);
+			PutUInt32(data, _height);
+			data.insert(data.end(), {8, 3, 0, 0, 0}); // 8 bits, indexed, deflate, no filter, no interlace
+			PutChunk(out, "IHDR", data);
+
+			data.clear();
+
+			for (int i=0; i<PARTICLETYPE_ENUM_LENGTH; i++) {
+				data.insert(data.end(), {(uint8_t)(_palette[i] >> 16), (uint8_t)(_palette[i] >> 8), (uint8_t)_palette[i]});
+			}
+
+			PutChunk(out, "PLTE", data);
+
+			// zlib stream of stored blocks over the rows, each one preceded by its filter byte
+			uint32_t a = 1, b = 0;
+			size_t length = (size_t)(_width + 1)*_height;
+			size_t block = 0;
+
+			data.assign({0x78, 0x01});
+
+			for (int y=0; y<_height; y++) {
+				for (int x=-1; x<_width; x++) {
+					if (block == 0) {
+						size_t left = length - (size_t)y*(_width + 1) - (x + 1);
+
+						block = std::min(left, (size_t)65535);
+
+						data.push_back((left == block)?1:0);
+						data.insert(data.end(), {(uint8_t)block, (uint8_t)(block >> 8), (uint8_t)~block, (uint8_t)(~block >> 8)});
+					}
+
+					uint8_t value = (x < 0)?0:frame.cells[x + y*_width];
+
+					data.push_back(value);
+
+					a = (a + value) % 65521;
+					b = (b + a) % 65521;
+					block--;
+				}
+			}
+
+			PutUInt32(data, (b << 16) | a);
+			PutChunk(out, "IDAT", data);
+
+			data.clear();
+			PutChunk(out, "IEND", data);
+		}
+
+		// Encoding a frame as a 4:4:4 Y4M frame (BT.601)
+		void EncodeY4M(const jcapture_frame_t &frame, std::vector<uint8_t> &out)
+		{
+			size_t length = (size_t)_width*_height;
+			static const char header[] = "FRAME\n";
+
+			out.resize(6 + 3*length);
+
+			memcpy(out.data(), header, 6);
+
+			uint8_t *y = out.data() + 6;
+			uint8_t *u = y + length;
+			uint8_t *v = u + length;
+
+			for (size_t i=0; i<length; i++) {
+				uint32_t color = _palette[frame.cells[i]];
+				int r = (color >> 16) & 0xff, g = (color >> 8) & 0xff, b = color & 0xff;
+
+				y[i] = (uint8_t)(16 + ((66*r + 129*g + 25*b + 128) >> 8));
+				u[i] = (uint8_t)(128 + ((-38*r - 74*g + 112*b + 128) >> 8));
+				v[i] = (uint8_t)(128 + ((112*r - 94*g - 18*b + 128) >> 8));
+			}
+		}
+
+		void Work()
+		{
+			std::vector<uint8_t> out;
+			std::vector<uint8_t> data;
+			char path[4096];
+
+			for (;;) {
+				jcapture_frame_t frame;
+
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+
+					_condition.wait(lock, [this] { return _queue.empty() == false || _running == false; });
+
+					if (_queue.empty() == true) {
+						return;
+					}
+
+					frame = std::move(_queue.front());
+					_queue.pop_front();
+				}
+
+				bool success = true;
+
+				if (_y4m == true) {
+					EncodeY4M(frame, out);
+
+					success = fwrite(out.data(), 1, out.size(), _stream) == out.size();
+				} else {
+					EncodePNG(frame, out, data);
+
+					snprintf(path, sizeof(path), "%s/frame%08llu.png", _target.c_str(), (unsigned long long)frame.tick);
+
+					FILE *file = fopen(path, "wb");
+
+					success = file != nullptr && fwrite(out.data(), 1, out.size(), file) == out.size();
+
+					if (file != nullptr) {
+						fclose(file);
+					}
+				}
+
+				if (success == true) {
+					_written++;
+				} else {
+					_dropped++;
+				}
+
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_pool.push_back(std::move(frame));
+			}
+		}
+
+	public:
+		// The target is a directory for a PNG sequence, or a file ending in .y4m
+		FrameCapture(std::string target, int width, int height, const uint32_t *colors):
+			_target(target),
+			_width(width),
+			_height(height),
+			_stream(nullptr),
+			_allocated(0),
+			_running(true),
+			_written(0),
+			_dropped(0)
+		{
+			_y4m = target.size() > 4 && target.compare(target.size() - 4, 4, ".y4m") == 0;
+
+			// the moved particles have the color of their particle
+			memset(_palette, 0, sizeof(_palette));
+
+			for (int t=0; t<PARTICLETYPE_ENUM_LENGTH; t++) {
+				_palette[t] = colors[(t >= JPT_WATER)?(t & ~1):t];
+			}
+
+			if (_y4m == true) {
+				_stream = fopen(target.c_str(), "wb");
+
+				if (_stream != nullptr) {
+					fprintf(_stream, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C444\n", _width, _height);
+				}
+			}
+
+			// a stream must be written in order, so it has a single writer
+			int workers = (_y4m == true)?1:std::max(1, std::min(4, (int)std::thread::hardware_concurrency() - 1));
+
+			for (int i=0; i<workers; i++) {
+				_workers.emplace_back(&FrameCapture::Work, this);
+			}
+		}
+
+		virtual ~FrameCapture()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_running = false;
+			}
+
+			_condition.notify_all();
+
+			for (auto &worker : _workers) {
+				worker.join();
+			}
+
+			if (_stream != nullptr) {
+				fclose(_stream);
+			}
+		}
+
+		bool IsOpen()
+		{
+			if (_y4m == true) {
+				return _stream != nullptr;
+			}
+
+			struct stat info;
+
+			return stat(_target.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+		}
+
+		// Taking a frame of the pool to be filled, which fails (and counts a dropped frame) when
+		// all of them are queued or being encoded
+		bool Acquire(jcapture_frame_t &frame)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			if (_pool.empty() == false) {
+				frame = std::move(_pool.back());
+				_pool.pop_back();
+			} else if (_allocated < CAPTURE_FRAMES) {
+				_allocated++;
+			} else {
+				_dropped++;
+
+				return false;
+			}
+
+			frame.cells.resize((size_t)_width*_height);
+
+			return true;
+		}
+
+		void Submit(jcapture_frame_t &&frame)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_queue.push_back(std::move(frame));
+			}
+
+			_condition.notify_one();
+		}
+
+		uint64_t GetWritten()
+		{
+			return _written;
+		}
+
+		uint64_t GetDropped()
+		{
+			return _dropped;
+		}
+};
+
+// Saving snapshots of the grid without pausing the simulation. The simulation only copies the grid
+// to a buffer at a tick boundary; the run-length encoding and the disk I/O run on a worker thread.
+// A snapshot that arrives while the worker is busy replaces the one waiting, and the files are
+// written to a temporary name and renamed, so a crash never leaves a partial checkpoint behind
+class Checkpointer {
+
+	private:
+		std::string _directory;
+		int _width;
+		int _height;
+		jcapture_frame_t _pending;
+		bool _queued;
+		std::vector<uint8_t> _spare;
+		std::deque<std::string> _files;
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::thread _worker;
+		bool _running;
+		std::atomic<uint64_t> _written;
+
+		// Encoding the cells as runs of (type, length), the length in 7 bit groups
+		static void Encode(const std::vector<uint8_t> &cells, std::vector<uint8_t> &out)
+		{
+			out.clear();
+
+			for (size_t i=0; i<cells.size();) {
+				size_t run = 1;
+
+				while (i + run < cells.size() && cells[i + run] == cells[i]) {
+					run++;
+				}
+
+				out.push_back(cells[i]);
+
+				for (size_t length=run; ; length >>= 7) {
+					if (length < 0x80) {
+						out.push_back(length);
+
+						break;
+					}
+
+					out.push_back((length & 0x7f) | 0x80);
+				}
+
+				i = i + run;
+			}
+		}
+
+		bool Write(const jcapture_frame_t &snapshot, const std::vector<uint8_t> &data)
+		{
+			char path[4096];
+			char temporary[4096 + 4];
+
+			snprintf(path, sizeof(path), "%s/checkpoint%012llu.jsnd", _directory.c_str(), (unsigned long long)snapshot.tick);
+			snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+			FILE *file = fopen(temporary, "wb");
+
+			if (file == nullptr) {
+				return false;
+			}
+
+			uint32_t header[4] = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, (uint32_t)_width, (uint32_t)_height};
+			uint64_t tick = snapshot.tick;
+			uint64_t length = data.size();
+
+			bool success = 
+        fwrite(header, sizeof(header), 1, file) == 1 && fwrite(&tick, sizeof(tick), 1, file) == 1 &&
+        fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(data.data(), 1, data.size(), file) == data.size() &&
+        fflush(file) == 0 && fsync(fileno(file)) == 0;
+
+			if (fclose(file) != 0 || success == false || rename(temporary, path) != 0) {
+				unlink(temporary);
+
+				return false;
+			}
+
+			// a restarted or resumed run writes the ticks of the files it found again, and the file
+			// replaced by the rename must not be pruned as one of the oldest
+			_files.erase(std::remove(_files.begin(), _files.end(), std::string(path)), _files.end());
+			_files.push_back(path);
+
+			// only the newest checkpoints are kept
+			while (_files.size() > CHECKPOINT_KEEP) {
+				unlink(_files.front().c_str());
+
+				_files.pop_front();
+			}
+
+			// the rename is only durable once the directory itself is synced
+			return SyncDirectory();
+		}
+
+		bool SyncDirectory()
+		{
+			int fd = open(_directory.c_str(), O_RDONLY | O_DIRECTORY);
+
+			if (fd < 0) {
+				return false;
+			}
+
+			bool success = (fsync(fd) == 0);
+
+			close(fd);
+
+			return success;
+		}
+
+		// Taking over the checkpoints left in the directory by earlier runs, oldest first, so they are
+		// pruned as the new ones are written. The temporaries of an interrupted write are removed
+		void ScanDirectory()
+		{
+			DIR *dir = opendir(_directory.c_str());
+
+			if (dir == nullptr) {
+				return;
+			}
+
+			std::vector<std::string> files;
+
+			while (struct dirent *entry = readdir(dir)) {
+				const char *name = entry->d_name;
+
+				// checkpoint<12 digits>.jsnd, as named by Write()
+				if (strncmp(name, "checkpoint", 10) != 0 || strspn(name + 10, "0123456789") != 12) {
+					continue;
+				}
+
+				if (strcmp(name + 22, ".jsnd") == 0) {
+					files.push_back(_directory + "/" + name);
+				} else if (strcmp(name + 22, ".jsnd.tmp") == 0) {
+					unlink((_directory + "/" + name).c_str());
+				}
+			}
+
+			closedir(dir);
+
+			// the ticks are padded with zeros, so the names sort by tick
+			std::sort(files.begin(), files.end());
+
+			_files.assign(files.begin(), files.end());
+		}
+
+		void Work()
+		{
+			std::vector<uint8_t> data;
+
+			for (;;) {
+				jcapture_frame_t snapshot;
+
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+
+					_condition.wait(lock, [this] { return _queued == true || _running == false; });
+
+					if (_queued == false) {
+						return;
+					}
+
+					snapshot = std::move(_pending);
+					_queued = false;
+				}
+
+				Encode(snapshot.cells, data);
+
+				if (Write(snapshot, data) == true) {
+					_written++;
+				} else {
+					fprintf(stderr, "checkpoint: unable to write tick %llu to %s\n", (unsigned long long)snapshot.tick, _directory.c_str());
+				}
+
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_spare = std::move(snapshot.cells);
+			}
+		}
+
+	public:
+		Checkpointer(std::string directory, int width, int height):
+			_directory(directory),
+			_width(width),
+			_height(height),
+			_queued(false),
+			_running(true),
+			_written(0)
+		{
+			ScanDirectory();
+
+			_worker = std::thread(&Checkpointer::Work, this);
+		}
+
+		virtual ~Checkpointer()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_running = false;
+			}
+
+			_condition.notify_all();
+
+			_worker.join();
+		}
+
+		bool IsOpen()
+		{
+			struct stat info;
+
+			return stat(_directory.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+		}
+
+		// Taking the buffer of a previous snapshot, if the worker is done with it, to be filled
+		void Acquire(jcapture_frame_t &snapshot)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			snapshot.cells = std::move(_spare);
+			snapshot.cells.resize((size_t)_width*_height);
+		}
+
+		void Submit(jcapture_frame_t &&snapshot)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_pending = std::move(snapshot);
+				_queued = true;
+			}
+
+			_condition.notify_one();
+		}
+
+		uint64_t GetWritten()
+		{
+			return _written;
+		}
+
+		// Reading a checkpoint of a grid of width x height cells
+		static bool Load(std::string path, int width, int height, jcapture_frame_t &snapshot)
+		{
+			FILE *file = fopen(path.c_str(), "rb");
+
+			if (file == nullptr) {
+				return false;
+			}
+
+			uint32_t header[4];
+			uint64_t length = 0;
+			std::vector<uint8_t> data;
+
+			bool success = 
+        fread(header, sizeof(header), 1, file) == 1 && fread(&snapshot.tick, sizeof(snapshot.tick), 1, file) == 1 &&
+        fread(&length, sizeof(length), 1, file) == 1 && header[0] == CHECKPOINT_MAGIC && header[1] == CHECKPOINT_VERSION &&
+        header[2] == (uint32_t)width && header[3] == (uint32_t)height && length <= (uint64_t)2*width*height;
+
+			if (success == true) {
+				data.resize(length);
+
+				success = fread(data.data(), 1, length, file) == length;
+			}
+
+			fclose(file);
+
+			snapshot.cells.clear();
+
+			for (size_t i=0; success == true && i<data.size();) {
+				uint8_t type = data[i++];
+				size_t run = 0;
+
+				for (int shift=0; ; shift+=7) {
+					if (i == data.size() || shift > 28) {
+						return false;
+					}
+
+					uint8_t byte = data[i++];
+
+					run = run | ((size_t)(byte & 0x7f) << shift);
+
+					if ((byte & 0x80) == 0) {
+						break;
+					}
+				}
+
+				if (type >= PARTICLETYPE_ENUM_LENGTH || type == JPT_BORDER || snapshot.cells.size() + run > (size_t)width*height) {
+					return false;
+				}
+
+				snapshot.cells.insert(snapshot.cells.end(), run, type);
+			}
+
+			return success == true && snapshot.cells.size() == (size_t)width*height;
+		}
+};
+
+// Command read from a client of the control server
+typedef struct {
+	int client;
+	uint8_t opcode;
+	std::vector<uint8_t> payload;
+} jcontrol_command_t;
+
+// Replies waiting to be sent to a client of the control server
+typedef struct {
+	std::vector<uint8_t> data;
+	bool dropped;
+} jcontrol_outbox_t;
+
+// Serving the control protocol (see jsandplus.h) on a Unix domain socket. A thread accepts the
+// clients and splits their streams in commands, which are queued until the simulation takes them
+// all at once at a tick boundary. The replies of the simulation are queued too, and the thread
+// sends them as the clients take them, so a slow client never holds a tick. The simulation closes
+// a socket when it takes the CONTROL_CLOSED command queued after the client went away, so a socket
+// is never reused while a reply may still be queued for it
+class ControlServer {
+
+	private:
+		std::string _path;
+		int _listener;
+		int _wakeup[2];
+		std::vector<jcontrol_command_t> _commands;
+		std::unordered_map<int, jcontrol_outbox_t> _outboxes;
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::thread _thread;
+		std::atomic<bool> _stopping;
+
+		void Queue(jcontrol_command_t &&command)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_commands.push_back(std::move(command));
+			}
+
+			_condition.notify_all();
+		}
+
+		// Sending what the socket of a client takes of its replies, false if the client went away
+		bool Flush(int client)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			std::vector<uint8_t> &data = _outboxes[client].data;
+
+			if (data.empty() == true) {
+				return true;
+			}
+
+			ssize_t w = send(client, data.data(), data.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+			if (w < 0) {
+				return errno == EAGAIN || errno == EWOULDBLOCK;
+			}
+
+			data.erase(data.begin(), data.begin() + w);
+
+			return true;
+		}
+
+		void Work()
+		{
+			std::vector<pollfd> fds;
+			std::vector<std::vector<uint8_t>> buffers;
+			uint8_t data[4096];
+
+			fds.push_back({_wakeup[0], POLLIN, 0});
+			fds.push_back({_listener, POLLIN, 0});
+			buffers.resize(2);
+
+			for (;;) {
+				// the clients with replies queued are waited for to take them too
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+
+					for (size_t i=2; i<fds.size(); i++) {
+						auto outbox = _outboxes.find(fds[i].fd);
+
+						fds[i].events = POLLIN | ((outbox != _outboxes.end() && outbox->second.data.empty() == false)?POLLOUT:0);
+					}
+				}
+
+				if (poll(fds.data(), fds.size(), -1) < 0) {
+					continue;
+				}
+
+				if (fds[0].revents != 0) {
+					if (read(_wakeup[0], data, sizeof(data)) <= 0 || _stopping == true) {
+						break;
+					}
+				}
+
+				if ((fds[1].revents & POLLIN) != 0) {
+					int client = accept(_listener, nullptr, nullptr);
+
+					if (client >= 0) {
+						fds.push_back({client, POLLIN, 0});
+						buffers.emplace_back();
+					}
+				}
+
+				for (size_t i=fds.size(); i-->2;) {
+					if (fds[i].revents == 0) {
+						continue;
+					}
+
+					std::vector<uint8_t> &buffer = buffers[i];
+					bool closed = ((fds[i].revents & POLLOUT) != 0 && Flush(fds[i].fd) == false);
+
+					if (closed == false && (fds[i].revents & ~POLLOUT) != 0) {
+						ssize_t r = read(fds[i].fd, data, sizeof(data));
+
+						closed = (r <= 0);
+
+						if (r > 0) {
+							buffer.insert(buffer.end(), data, data + r);
+						}
+					}
+
+					size_t offset = 0;
+
+					while (closed == false && buffer.size() - offset >= sizeof(jcontrol_header_t)) {
+						jcontrol_header_t header;
+
+						memcpy(&header, buffer.data() + offset, sizeof(header));
+
+						// a client out of sync can't be understood anymore
+						if (header.length > CONTROL_MAXIMUM_PAYLOAD) {
+							closed = true;
+
+							break;
+						}
+
+						if (buffer.size() - offset < sizeof(header) + header.length) {
+							break;
+						}
+
+						const uint8_t *payload = buffer.data() + offset + sizeof(header);
+
+						Queue({fds[i].fd, header.opcode, std::vector<uint8_t>(payload, payload + header.length)});
+
+						offset = offset + sizeof(header) + header.length;
+					}
+
+					buffer.erase(buffer.begin(), buffer.begin() + offset);
+
+					if (closed == true) {
+						Queue({fds[i].fd, CONTROL_CLOSED, {}});
+
+						fds.erase(fds.begin() + i);
+						buffers.erase(buffers.begin() + i);
+					}
+				}
+			}
+
+			// the clients left are closed with the server, nothing replies anymore
+			for (size_t i=2; i<fds.size(); i++) {
+				close(fds[i].fd);
+			}
+		}
+
+	public:
+		ControlServer(std::string path):
+			_path(path),
+			_listener(-1),
+			_stopping(false)
+		{
+			_wakeup[0] = _wakeup[1] = -1;
+
+			sockaddr_un address;
+
+			memset(&address, 0, sizeof(address));
+
+			address.sun_family = AF_UNIX;
+
+			if (path.size() >= sizeof(address.sun_path) || pipe(_wakeup) < 0) {
+				return;
+			}
+
+			strcpy(address.sun_path, path.c_str());
+
+			// the simulation wakes the server up for every reply and must never wait for it
+			fcntl(_wakeup[1], F_SETFL, O_NONBLOCK);
+
+			_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+			if (_listener < 0) {
+				return;
+			}
+
+			unlink(path.c_str());
+
+			if (bind(_listener, (sockaddr *)&address, sizeof(address)) < 0 || listen(_listener, 8) < 0) {
+				close(_listener);
+
+				_listener = -1;
+
+				return;
+			}
+
+			_thread = std::thread(&ControlServer::Work, this);
+		}
+
+		virtual ~ControlServer()
+		{
+			if (_thread.joinable() == true) {
+				char stop = 0;
+
+				_stopping = true;
+
+				// a full pipe wakes the server up as well
+				if (write(_wakeup[1], &stop, 1) < 0 && errno != EAGAIN) {
+					perror("write");
+				}
+
+				_thread.join();
+			}
+
+			if (_listener >= 0) {
+				close(_listener);
+				unlink(_path.c_str());
+			}
+
+			if (_wakeup[0] >= 0) {
+				close(_wakeup[0]);
+				close(_wakeup[1]);
+			}
+		}
+
+		bool IsOpen()
+		{
+			return _listener >= 0;
+		}
+
+		// Taking all the commands that arrived since the last call
+		void Take(std::vector<jcontrol_command_t> &commands)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			commands.swap(_commands);
+			_commands.clear();
+		}
+
+		// Waiting for a command, for the simulation that has nothing else to do
+		void Wait(std::chrono::milliseconds timeout)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+
+			_condition.wait_for(lock, timeout, [this] { return _commands.empty() == false; });
+		}
+
+		// Queueing a reply for the server to send. A client that doesn't take its replies is
+		// disconnected, the server sees it go away
+		void Reply(int client, uint8_t opcode, const void *payload, uint32_t length, const void *data = nullptr, uint32_t data_length = 0)
+		{
+			jcontrol_header_t header = {opcode, 0, 0, length + data_length};
+			bool wakeup;
+
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				jcontrol_outbox_t &outbox = _outboxes[client];
+
+				if (outbox.dropped == true) {
+					return;
+				}
+
+				if (outbox.data.size() + sizeof(header) + length + data_length > CONTROL_MAXIMUM_PENDING) {
+					outbox.dropped = true;
+					outbox.data.clear();
+
+					shutdown(client, SHUT_RDWR);
+
+					return;
+				}
+
+				wakeup = outbox.data.empty();
+
+				outbox.data.insert(outbox.data.end(), (const uint8_t *)&header, (const uint8_t *)&header + sizeof(header));
+				outbox.data.insert(outbox.data.end(), (const uint8_t *)payload, (const uint8_t *)payload + length);
+				outbox.data.insert(outbox.data.end(), (const uint8_t *)data, (const uint8_t *)data + data_length);
+			}
+
+			if (wakeup == true) {
+				char flush = 1;
+
+				if (write(_wakeup[1], &flush, 1) < 0 && errno != EAGAIN) {
+					perror("write");
+				}
+			}
+		}
+
+		// Closing the socket of a client that went away, with the replies it didn't take
+		void Close(int client)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+
+				_outboxes.erase(client);
+			}
+
+			close(client);
+		}
+};
+
+// Frames streamed to a client of the control server
+typedef struct {
+	int client;
+	int scale;
+	uint32_t interval;
+	uint64_t next;
+} jframe_subscription_t;
+
+// Set by SIGINT and SIGTERM to leave the loop of the headless simulation
+static volatile sig_atomic_t headless_stop = 0;
+
+class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanvas::MouseListener {
+
+	private:
+		typedef void (Screen::*jmove_kernel_t)(int, int, CellRandom &);
+
+		jparticle_type_t *_vs;
+		int _stride;
+		int _cells;
+		BitGrid *_occupancy;
+		BitGrid *_motion;
+		BitGrid *_sleep;
+		int _sleepers;
+		uint8_t _dispersion[PARTICLETYPE_ENUM_LENGTH];
+		jmove_kernel_t _kernels[PARTICLETYPE_ENUM_LENGTH];
+		int *_conductor;
+		uint32_t *_energized;
+		BitGrid *_unlinked;
+		uint32_t *_relabelled;
+		uint32_t _relabel_pass;
+		std::vector<std::pair<int, uint32_t>> _relabel_seeds;
+		std::vector<int> _relabel_queue;
+		bool _conductive[PARTICLETYPE_ENUM_LENGTH];
+		uint16_t *_layers[LAYER_COUNT];
+		int _layer_users[LAYER_COUNT];
+		uint8_t _layered[PARTICLETYPE_ENUM_LENGTH];
+		uint16_t _lifetime[PARTICLETYPE_ENUM_LENGTH];
+		bool _memoryless[PARTICLETYPE_ENUM_LENGTH];
+		uint16_t _decay[PARTICLETYPE_ENUM_LENGTH];
+		TimingWheel _timers;
+		std::unordered_map<int, uint64_t> _decay_due;
+		bool _conduction_dirty;
+		uint64_t _last_spark;
+		bool _level_liquids;
+		std::vector<int> _active;
+		std::vector<jfast_particle_t> _fast;
+		std::vector<std::thread> _margolus_workers;
+		std::vector<jmargolus_band_t> _margolus_bands;
+		std::mutex _margolus_mutex;
+		std::condition_variable _margolus_start;
+		std::condition_variable _margolus_done;
+		uint64_t _margolus_generation;
+		int _margolus_phase;
+		int _margolus_pending;
+		bool _margolus_stop;
+		uint8_t *_active_mark;
+		uint8_t _reactivity[PARTICLETYPE_ENUM_LENGTH];
+		jparticle_type_t _current_particle;
+		jcanvas::jrect_t<int> _scene;
+		jbutton_rect_t _buttons[BUTTON_COUNT];
+		float _water_density;
+		float _sand_density;
+		float _salt_density;
+		float _oil_density;
+		int _slow;
+		int _upper_row_y;
+		int _middle_row_y;
+		int _lower_row_y;
+		int _particle_count;
+		int _pen_size;
+		int _old_x;
+		int _old_y;
+		int _mb_x;
+		int _mb_y;
+		int _can_move_x;
+		int _can_move_y;
+		int _speed_x;
+		int _speed_y;
+		bool _is_button_down;
+		bool _emit_water;
+		bool _emit_sand;
+		bool _emit_salt;
+		bool _emit_oil;
+		bool _implement_particle_swaps;
+		jsimulation_engine_t _engine;
+		uint8_t _margolus_class[PARTICLETYPE_ENUM_LENGTH];
+		uint16_t _margolus_decay[PARTICLETYPE_ENUM_LENGTH];
+		uint8_t _margolus_rules[2][MARGOLUS_STATES];
+		uint64_t _tick;
+		uint64_t _seed;
+		float *_heat;
+		float *_heat_next;
+		float _heat_source[PARTICLETYPE_ENUM_LENGTH];
+		int _heat_stride;
+		float _update_time;
+		float _paint_time;
+		float _frame_time;
+		float *_row_cost;
+		float _lag;
+		int _next_row;
+		bool _budget_mode;
+		bool _tick_open;
+		std::vector<int> _unsettled;
+		uint32_t *_pixels;
+		BitGrid *_damage;
+		jcanvas::Image *_dashboard;
+		int _dashboard_key;
+		bool _sparks_drawn;
+		std::deque<jhistory_entry_t> _undo;
+		std::vector<jhistory_entry_t> _redo;
+		jhistory_entry_t _edit;
+		bool _editing;
+		int _edit_serial;
+		int *_chunk_serial;
+		int *_chunk_slot;
+		size_t _history_size;
+		std::vector<jparticle_type_t> _run;
+		std::vector<jprefab_t> _prefabs;
+		int _current_prefab;
+		jprefab_t _clipboard;
+		jshared_grid_t *_shared;
+		size_t _shared_size;
+		std::string _shared_name;
+		FrameCapture *_capture;
+		int _capture_interval;
+		uint64_t _next_capture;
+		Checkpointer *_checkpoint;
+		int _checkpoint_interval;
+		uint64_t _next_checkpoint;
+		ControlServer *_control;
+		std::vector<jcontrol_command_t> _control_commands;
+		std::vector<int> _step_clients;
+		std::vector<jframe_subscription_t> _subscriptions;
+		std::vector<uint8_t> _frame_cells;
+		bool _paused;
+		uint32_t _steps;
+		uint32_t *_cost_ticks;
+		float *_cost;
+		int _cost_columns;
+		int _cost_rows;
+		bool _cost_overlay;
+		std::vector<uint8_t> _mip[MIP_LEVELS];
+		int _mip_width[MIP_LEVELS];
+		int _mip_height[MIP_LEVELS];
+		int _mip_columns;
+		int _mip_rows;
+		BitGrid *_mip_dirty;
+		uint32_t *_overview_pixels;
+		int _overview_level;
+		int _overview_x;
+		int _overview_y;
+#ifdef JSAND_REACTION_COUNTERS
+		uint32_t _reactions[PARTICLETYPE_ENUM_LENGTH*PARTICLETYPE_ENUM_LENGTH];
+		uint64_t _reaction_totals[PARTICLETYPE_ENUM_LENGTH*PARTICLETYPE_ENUM_LENGTH];
+		float _reaction_rate[PARTICLETYPE_ENUM_LENGTH*PARTICLETYPE_ENUM_LENGTH];
+		FILE *_reaction_stream;
+		bool _reaction_panel;
+#endif
+
+	public:
+		Screen(jcanvas::jpoint_t<int> wsize = {720, 480}):
+			jcanvas::Window(wsize)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			// the rows are padded with sentinels and start at a cache line, so the neighbours of any
+			// cell of the screen can be read without checking the bounds
+#ifdef JSAND_TILED_LAYOUT
+			_stride = ((size.x + 2*GRID_PADDING + GRID_TILE - 1)/GRID_TILE)*GRID_TILE;
+			_cells = _stride*(((size.y - DASHBOARD_SIZE + 2*GRID_PADDING + GRID_TILE - 1)/GRID_TILE)*GRID_TILE);
+#else
+			_stride = size.x + 2*GRID_PADDING;
+			_stride = ((_stride*sizeof(jparticle_type_t) + GRID_ALIGNMENT - 1)/GRID_ALIGNMENT)*GRID_ALIGNMENT/sizeof(jparticle_type_t);
+			_cells = _stride*(size.y - DASHBOARD_SIZE + 2*GRID_PADDING);
+#endif
+
+			_vs = (jparticle_type_t *)aligned_alloc(GRID_ALIGNMENT, _cells*sizeof(jparticle_type_t));
+
+			std::fill(_vs, _vs + _cells, JPT_BORDER);
+
+			// the screen starts empty, so clearing it doesn't leave an edit in the undo history
+			for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+				for (int x=0; x<size.x; x++) {
+					_vs[Index(x, y)] = JPT_NOTHING;
+				}
+			}
+
+			_active_mark = new uint8_t[_cells]();
+			_occupancy = new BitGrid(_cells);
+			_motion = new BitGrid(_cells);
+			_sleep = new BitGrid(_cells);
+			_sleepers = 0;
+
+			_row_cost = new float[size.y]();
+
+			_pixels = new uint32_t[size.x*(size.y - DASHBOARD_SIZE)]();
+			_damage = new BitGrid((_cells >> DAMAGE_SHIFT) + 1);
+			_dashboard = nullptr;
+			_dashboard_key = -1;
+			_sparks_drawn = false;
+
+			_editing = false;
+			_edit_serial = 0;
+			_chunk_serial = new int[(_cells >> HISTORY_CHUNK_SHIFT) + 1]();
+			_chunk_slot = new int[(_cells >> HISTORY_CHUNK_SHIFT) + 1]();
+			_history_size = 0;
+
+			_current_prefab = 0;
+			_clipboard.width = 0;
+			_clipboard.height = 0;
+
+			_shared = nullptr;
+			_shared_size = 0;
+
+			_capture = nullptr;
+			_capture_interval = 1;
+			_next_capture = 0;
+
+			_checkpoint = nullptr;
+			_checkpoint_interval = CHECKPOINT_INTERVAL;
+			_next_checkpoint = 0;
+
+			_control = nullptr;
+			_paused = false;
+			_steps = 0;
+
+			_cost_columns = (size.x + COST_TILE - 1)/COST_TILE;
+			_cost_rows = (size.y - DASHBOARD_SIZE + COST_TILE - 1)/COST_TILE;
+			_cost_ticks = new uint32_t[_cost_columns*_cost_rows]();
+			_cost = new float[_cost_columns*_cost_rows]();
+			_cost_overlay = false;
+
+			for (int k=0; k<MIP_LEVELS; k++) {
+				_mip_width[k] = (size.x + (2 << k) - 1) >> (k + 1);
+				_mip_height[k] = (size.y - DASHBOARD_SIZE + (2 << k) - 1) >> (k + 1);
+				_mip[k].assign(_mip_width[k]*_mip_height[k], JPT_NOTHING);
+			}
+
+			_mip_columns = (size.x + (1 << MIP_LEVELS) - 1) >> MIP_LEVELS;
+			_mip_rows = (size.y - DASHBOARD_SIZE + (1 << MIP_LEVELS) - 1) >> MIP_LEVELS;
+			_mip_dirty = new BitGrid(_mip_columns*_mip_rows);
+			_overview_pixels = new uint32_t[OVERVIEW_WIDTH*OVERVIEW_HEIGHT];
+			_overview_level = 0;
+			_overview_x = 0;
+			_overview_y = 0;
+
+#ifdef JSAND_REACTION_COUNTERS
+			std::fill(std::begin(_reactions), std::end(_reactions), 0);
+			std::fill(std::begin(_reaction_totals), std::end(_reaction_totals), 0);
+			std::fill(std::begin(_reaction_rate), std::end(_reaction_rate), 0.0f);
+
+			_reaction_stream = nullptr;
+			_reaction_panel = false;
+#endif
+
+			_conductor = new int[_cells];
+			_energized = new uint32_t[_cells]();
+			_unlinked = new BitGrid(_cells);
+			_relabelled = new uint32_t[_cells]();
+			_relabel_pass = 0;
+			_conduction_dirty = false;
+			_last_spark = 0;
+
+			std::fill(_conductor, _conductor + _cells, -1);
+
+			std::fill(_layers, _layers + LAYER_COUNT, nullptr);
+			std::fill(_layer_users, _layer_users + LAYER_COUNT, 0);
+
+			// the heat grid has a border of one cell at the ambient temperature
+			_heat_stride = ((size.x + 2 + 3)/4)*4;
+			_heat = new float[_heat_stride*(size.y + 2)];
+			_heat_next = new float[_heat_stride*(size.y + 2)];
+
+			std::fill(_heat, _heat + _heat_stride*(size.y + 2), HEAT_AMBIENT);
+			std::fill(_heat_next, _heat_next + _heat_stride*(size.y + 2), HEAT_AMBIENT);
+
+			_water_density = 0.3f;
+			_sand_density = 0.3f;
+			_salt_density = 0.3f;
+			_oil_density = 0.3f;
+
+			_emit_water = true;
+			_emit_sand = true;
+			_emit_salt = true;
+			_emit_oil = true;
+
+			_can_move_x = 0;
+			_can_move_y = 0;
+			_mb_x = 0;
+			_mb_y = 0;
+			_old_x = size.x/2;
+			_old_y = size.y/2;
+			_is_button_down = false;
+
+			_particle_count = 0;
+			_pen_size = 2;
+			_slow = false;
+			_speed_x = 0;
+			_speed_y = 0;
+			_current_particle = JPT_WALL;
+
+			_implement_particle_swaps = true;
+			_level_liquids = false;
+
+			_engine = JSE_CELLULAR;
+			_tick = 0;
+			_seed = 0;
+			_update_time = 0.0f;
+			_paint_time = 0.0f;
+			_frame_time = 16.0f;
+			_lag = 0.0f;
+			_next_row = 0;
+			_budget_mode = false;
+			_margolus_generation = 0;
+			_margolus_phase = 0;
+			_margolus_pending = 0;
+			_margolus_stop = false;
+			_tick_open = false;
+
+			_upper_row_y = size.y - BUTTON_SIZE - 1;
+			_middle_row_y = size.y - BUTTON_SIZE - 1;
+			_lower_row_y = size.y - BUTTON_SIZE - 1;
+
+			init();
+			Clear();
+
+			// nothing done before the first edit of the user can be undone
+			_undo.clear();
+			_redo.clear();
+		}
+
+		virtual ~Screen()
+		{
+			if (_margolus_workers.empty() == false) {
+				{
+					std::lock_guard<std::mutex> lock(_margolus_mutex);
+
+					_margolus_stop = true;
+				}
+
+				_margolus_start.notify_all();
+
+				for (auto &worker : _margolus_workers) {
+					worker.join();
+				}
+			}
+
+			free(_vs);
+			delete [] _active_mark;
+			delete _occupancy;
+			delete _motion;
+			delete _sleep;
+			delete [] _row_cost;
+			delete [] _pixels;
+			delete _damage;
+			delete _dashboard;
+			delete [] _chunk_serial;
+			delete [] _chunk_slot;
+
+			if (_shared != nullptr) {
+				munmap(_shared, _shared_size);
+				shm_unlink(_shared_name.c_str());
+			}
+
+			if (_capture != nullptr) {
+				// the workers finish the queued frames before the capture goes away
+				delete _capture;
+			}
+
+			if (_checkpoint != nullptr) {
+				// the checkpoint being written is finished first
+				delete _checkpoint;
+			}
+
+			if (_control != nullptr) {
+				delete _control;
+			}
+
+#ifdef JSAND_REACTION_COUNTERS
+			if (_reaction_stream != nullptr) {
+				fclose(_reaction_stream);
+			}
+#endif
+
+			delete [] _cost_ticks;
+			delete [] _cost;
+			delete _mip_dirty;
+			delete [] _overview_pixels;
+			delete [] _conductor;
+			delete [] _energized;
+			delete _unlinked;
+			delete [] _relabelled;
+
+			for (int l=0; l<LAYER_COUNT; l++) {
+				delete [] _layers[l];
+			}
+
+			delete [] _heat;
+			delete [] _heat_next;
+		}
+
+		// Index of (x, y) in the virtual screen. The sentinels are at x = -1, x >= size.x, y = -1 and
+		// at the row below the screen. The cells of a row are contiguous in runs of RunEnd() cells,
+		// everything else must walk the screen through Index(), Neighbour() and Position()
+		inline int Index(int x, int y)
+		{
+			x = x + GRID_PADDING;
+			y = y + GRID_PADDING;
+
+#ifdef JSAND_TILED_LAYOUT
+			return ((y & ~(GRID_TILE - 1))*_stride) + ((x & ~(GRID_TILE - 1))*GRID_TILE) + ((y & (GRID_TILE - 1))*GRID_TILE) + (x & (GRID_TILE - 1));
+#else
+			return x + (y*_stride);
+#endif
+		}
+
+		// Index of the cell at (dx, dy) from the cell at index, with dx and dy in [-1, 1]
+		inline int Neighbour(int index, int dx, int dy)
+		{
+#ifdef JSAND_TILED_LAYOUT
+			int 
+        x = (index & (GRID_TILE - 1)) + dx,
+        y = ((index/GRID_TILE) & (GRID_TILE - 1)) + dy,
+        offset = dx + (dy*GRID_TILE);
+
+			// stepping out of the tile lands on the opposite side of the next one
+			if (x < 0) {
+				offset = offset - (GRID_TILE*GRID_TILE - GRID_TILE);
+			} else if (x >= GRID_TILE) {
+				offset = offset + (GRID_TILE*GRID_TILE - GRID_TILE);
+			}
+
+			if (y < 0) {
+				offset = offset - (GRID_TILE*_stride - GRID_TILE*GRID_TILE);
+			} else if (y >= GRID_TILE) {
+				offset = offset + (GRID_TILE*_stride - GRID_TILE*GRID_TILE);
+			}
+
+			return index + offset;
+#else
+			return index + dx + (dy*_stride);
+#endif
+		}
+
+		// Coordinates of the cell at index
+		inline jcanvas::jpoint_t<int> Position(int index)
+		{
+#ifdef JSAND_TILED_LAYOUT
+			int 
+        tile = index/(GRID_TILE*GRID_TILE),
+        tiles = _stride/GRID_TILE;
+
+			return {
+				(tile % tiles)*GRID_TILE + (index & (GRID_TILE - 1)) - GRID_PADDING,
+				(tile / tiles)*GRID_TILE + ((index/GRID_TILE) & (GRID_TILE - 1)) - GRID_PADDING
+			};
+#else
+			return {
+				index % _stride - GRID_PADDING, index / _stride - GRID_PADDING
+			};
+#endif
+		}
+
+		// End (exclusive) of the run of contiguous cells of a row that holds the column x
+		inline int RunEnd([[maybe_unused]] int x)
+		{
+#ifdef JSAND_TILED_LAYOUT
+			return ((x + GRID_PADDING) | (GRID_TILE - 1)) + 1 - GRID_PADDING;
+#else
+			return _stride;
+#endif
+		}
+
+		// Start of the run of contiguous cells of a row that holds the column x
+		inline int RunBegin([[maybe_unused]] int x)
+		{
+#ifdef JSAND_TILED_LAYOUT
+			return ((x + GRID_PADDING) & ~(GRID_TILE - 1)) - GRID_PADDING;
+#else
+			return -GRID_PADDING;
+#endif
+		}
+
+		// First column in [from, to) of the row y set in bits, or -1
+		inline int NextInRow(BitGrid *bits, int from, int to, int y)
+		{
+			while (from < to) {
+				int end = std::min(to, RunEnd(from));
+				int begin = Index(from, y);
+				int index = bits->Next(begin, begin + (end - from));
+
+				if (index >= 0) {
+					return from + (index - begin);
+				}
+
+				from = end;
+			}
+
+			return -1;
+		}
+
+		// Last column in [from, to) of the row y set in bits, or -1
+		inline int PreviousInRow(BitGrid *bits, int from, int to, int y)
+		{
+			while (from < to) {
+				int start = std::max(from, RunBegin(to - 1));
+				int begin = Index(start, y);
+				int index = bits->Previous(begin, begin + (to - start));
+
+				if (index >= 0) {
+					return start + (index - begin);
+				}
+
+				to = start;
+			}
+
+			return -1;
+		}
+
+		//Checks wether a given particle type is a stillborn element
+		bool IsStillborn(jparticle_type_t t)
+		{
+			return (t >= STILLBORN_LOWER_BOUND && t <= STILLBORN_UPPER_BOUND);
+		}
+
+		//Checks wether a given particle type is updated by a move kernel
+		bool IsMoving(jparticle_type_t t)
+		{
+			return (t > STILLBORN_UPPER_BOUND);
+		}
+
+		//Checks wether a given particle type is a floting type - like FIRE and STEAM
+		bool IsFloating(jparticle_type_t t)
+		{
+			return (t >= FLOATING_LOWER_BOUND && t <= FLOATING_UPPER_BOUND);
+		}
+
+		// The generator of the random decisions about the cell (x, y) in this tick
+		inline CellRandom Random(int x, int y, int stream)
+		{
+			return CellRandom(_seed, _tick, x, y, stream);
+		}
+
+		// Picking one of the 4 neighbours of a cell at random
+		inline int RandomNeighbour(CellRandom &rng, int above, int below, int first, int second)
+		{
+			switch (rng.Next()%4) {
+				case 0: return above;
+				case 1: return below;
+				case 2: return first;
+				default: return second;
+			}
+		}
+
+		//Checks wether a given particle type is burnable - like JPT_PLANT and OIL
+		bool IsBurnable(jparticle_type_t t)
+		{
+			return (t == JPT_PLANT || t == JPT_OIL || t == JPT_MOVEDOIL);
+		}
+
+		//Checks wether a given particle type is burnable - like JPT_PLANT and OIL
+		bool BurnsAsEmber(jparticle_type_t t)
+		{
+			return (t == JPT_PLANT); //Maybe we'll add a FUSE or WOOD
+		}
+
+		uint32_t colors[PARTICLETYPE_ENUM_LENGTH];
+
+		// Initializing colors
+		void initColors()
+		{
+			colors[JPT_NOTHING] = 0xff000000;
+
+			//STILLBORN
+			colors[JPT_SAND] = 0xffeecc80;
+			colors[JPT_WALL] = 0xff646464;
+			colors[JPT_VOID] = 0xff3c3c3c;
+			colors[JPT_IRONWALL] = 0xff6e6e6e;
+			colors[JPT_TORCH] = 0xff8b4520;
+			colors[JPT_STOVE] = 0xff4a4a4a;
+			colors[JPT_ICE] = 0xffafeeee;
+			colors[JPT_PLANT] = 0xff009600;
+			colors[JPT_EMBER] = 0xff7f2020;
+			colors[JPT_RUST] = 0xff6e280a;
+
+			//ELEMENTAL
+			colors[JPT_WATER] = 0xff2020ff;
+			colors[JPT_DIRT] = 0xffcdaf96;
+			colors[JPT_SALT] = 0xffffffff;
+			colors[JPT_OIL] = 0xff804040;
+
+			//COMBINED
+			colors[JPT_MUD] = 0xff8b4515;
+			colors[JPT_SALTWATER] = 0xff4070e0;
+			colors[JPT_STEAM] = 0xff5f9ea0;
+
+			//EXTRA
+			colors[JPT_ACID] = 0xffadff2f;
+			colors[JPT_FIRE] = 0xffff3232;
+			colors[JPT_ELEC] = 0xffffff00;
+
+			//SPOUTS
+			colors[JPT_WATERSPOUT] = 0xff000080;
+			colors[JPT_SANDSPOUT] = 0xfff0e68c;
+			colors[JPT_SALTSPOUT] = 0xffeeeaea;
+			colors[JPT_OILSPOUT] = 0xff6c2c2c;
+
+			// the moved particles look like the resting ones
+			for (int t=JPT_WATER; t<PARTICLETYPE_ENUM_LENGTH; t+=2) {
+				colors[t + 1] = colors[t];
+			}
+		}
+
+		// Initializing the reactivity table. Only the stillborn particles that can act go to the
+		// active list, plain walls and ice are just obstacles and never get visited
+		void initReactivity()
+		{
+			memset(_reactivity, 0, sizeof(_reactivity));
+
+			_reactivity[JPT_TORCH] = REACTIVE_ALWAYS;
+			_reactivity[JPT_RUST] = TRIGGERS_NEAR_RUST;
+			_reactivity[JPT_EMBER] = REACTIVE_ALWAYS;
+			_reactivity[JPT_VOID] = REACTIVE_ALWAYS;
+			_reactivity[JPT_WATERSPOUT] = REACTIVE_ALWAYS;
+			_reactivity[JPT_SANDSPOUT] = REACTIVE_ALWAYS;
+			_reactivity[JPT_SALTSPOUT] = REACTIVE_ALWAYS;
+			_reactivity[JPT_OILSPOUT] = REACTIVE_ALWAYS;
+			_reactivity[JPT_PLANT] = REACTIVE_NEAR_WATER;
+			_reactivity[JPT_IRONWALL] = REACTIVE_NEAR_RUST;
+			_reactivity[JPT_WATER] = TRIGGERS_NEAR_WATER;
+			_reactivity[JPT_MOVEDWATER] = TRIGGERS_NEAR_WATER;
+		}
+
+		// Initializing the mean number of ticks before a particle decays into nothing. The decays are
+		// scheduled in the timing wheel, so the particles don't need to be visited meanwhile
+		void initDecay()
+		{
+			std::fill(_decay, _decay + PARTICLETYPE_ENUM_LENGTH, 0);
+
+			_decay[JPT_RUST] = 7000;
+		}
+
+		// Scheduling the decay of a new cell after a geometric number of ticks, which is when a roll of
+		// 1/_decay[type] per tick would have succeeded. The cells that stop decaying keep their timer
+		// until it's due, and are told apart because the due tick isn't theirs anymore
+		void DecayChanged(int index, jparticle_type_t type)
+		{
+			if (_decay[type] == 0) {
+				_decay_due.erase(index);
+
+				return;
+			}
+
+			jcanvas::jpoint_t<int> position = Position(index);
+			float u = 1.0f - Random(position.x, position.y, RANDOM_DECAY).NextFloat();
+			uint64_t due = _tick + 1 + (uint64_t)(logf(u)/log1pf(-1.0f/_decay[type]));
+
+			_decay_due[index] = due;
+			_timers.Schedule(index, due);
+		}
+
+		// Running the decays that are due at this tick
+		inline void UpdateDecays()
+		{
+			if (_decay_due.empty() == true) {
+				_timers.Reset(_tick);
+
+				return;
+			}
+
+			_timers.Advance(_tick, [&](const jtimer_t &timer) {
+				auto i = _decay_due.find(timer.index);
+
+				if (i != _decay_due.end() && i->second == timer.due) {
+					React(timer.index, JPT_NOTHING);
+				}
+			});
+		}
+
+		// Scheduling the decays of the whole screen again, after it was replaced at once
+		void ScheduleDecays()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			_timers.Reset(_tick);
+			_decay_due.clear();
+
+			for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+				for (int x=0; x<size.x; x++) {
+					int index = Index(x, y);
+
+					if (_decay[_vs[index]] != 0) {
+						DecayChanged(index, _vs[index]);
+					}
+				}
+			}
+		}
+
+		// Initializing how many cells a particle can travel sideways in a single update
+		void initDispersion()
+		{
+			memset(_dispersion, 1, sizeof(_dispersion));
+
+			_dispersion[JPT_MOVEDWATER] = 8;
+			_dispersion[JPT_MOVEDSALTWATER] = 6;
+			_dispersion[JPT_MOVEDACID] = 5;
+			_dispersion[JPT_MOVEDOIL] = 4;
+		}
+
+		// Initializing the move kernel of each moving particle, indexed by its resting type
+		void initKernels()
+		{
+			std::fill(_kernels, _kernels + PARTICLETYPE_ENUM_LENGTH, nullptr);
+
+			_kernels[JPT_WATER] = &Screen::MoveKernel<JPT_MOVEDWATER>;
+			_kernels[JPT_DIRT] = &Screen::MoveKernel<JPT_MOVEDDIRT>;
+			_kernels[JPT_SALT] = &Screen::MoveKernel<JPT_MOVEDSALT>;
+			_kernels[JPT_OIL] = &Screen::MoveKernel<JPT_MOVEDOIL>;
+			_kernels[JPT_SAND] = &Screen::MoveKernel<JPT_MOVEDSAND>;
+			_kernels[JPT_SALTWATER] = &Screen::MoveKernel<JPT_MOVEDSALTWATER>;
+			_kernels[JPT_MUD] = &Screen::MoveKernel<JPT_MOVEDMUD>;
+			_kernels[JPT_ACID] = &Screen::MoveKernel<JPT_MOVEDACID>;
+			_kernels[JPT_STEAM] = &Screen::MoveKernel<JPT_MOVEDSTEAM>;
+			_kernels[JPT_FIRE] = &Screen::MoveKernel<JPT_MOVEDFIRE>;
+			_kernels[JPT_ELEC] = &Screen::MoveKernel<JPT_MOVEDELEC>;
+		}
+
+		// Initializing the particles that conduct electricity
+		void initConduction()
+		{
+			std::fill(_conductive, _conductive + PARTICLETYPE_ENUM_LENGTH, false);
+
+			_conductive[JPT_IRONWALL] = true;
+			_conductive[JPT_WATER] = true;
+			_conductive[JPT_MOVEDWATER] = true;
+			_conductive[JPT_SALTWATER] = true;
+			_conductive[JPT_MOVEDSALTWATER] = true;
+		}
+
+		// Initializing the layers used by each particle. The moved variant of a particle uses the same
+		// layers, so clearing the moved flag keeps them
+		void initLayers()
+		{
+			std::fill(_layered, _layered + PARTICLETYPE_ENUM_LENGTH, 0);
+			std::fill(_lifetime, _lifetime + PARTICLETYPE_ENUM_LENGTH, 0);
+			std::fill(_memoryless, _memoryless + PARTICLETYPE_ENUM_LENGTH, false);
+
+			_layered[JPT_FIRE] = _layered[JPT_MOVEDFIRE] = 1 << LAYER_LIFETIME;
+			_layered[JPT_EMBER] = 1 << LAYER_LIFETIME;
+			_layered[JPT_STEAM] = _layered[JPT_MOVEDSTEAM] = 1 << LAYER_LIFETIME;
+
+			// the mean number of ticks that fire rises and that an ember glows
+			_lifetime[JPT_FIRE] = _lifetime[JPT_MOVEDFIRE] = 20;
+			_lifetime[JPT_EMBER] = 18;
+
+			// steam that can't rise condenses (1 in 1000) or vanishes (1 in 500) at every update, so its
+			// lifetime is geometric, with a mean of about 333 updates
+			_lifetime[JPT_STEAM] = _lifetime[JPT_MOVEDSTEAM] = 333;
+			_memoryless[JPT_STEAM] = _memoryless[JPT_MOVEDSTEAM] = true;
+		}
+
+		// Accounting a cell that started or stopped using some layers. A layer is allocated by its first
+		// user and released by EndTick() once it has none
+		void LayersChanged(int index, jparticle_type_t old, jparticle_type_t type)
+		{
+			uint8_t gained = _layered[type] & ~_layered[old];
+			uint8_t lost = _layered[old] & ~_layered[type];
+
+			for (int l=0; l<LAYER_COUNT; l++) {
+				if (lost & (1 << l)) {
+					_layer_users[l]--;
+				}
+
+				if (gained & (1 << l)) {
+					if (_layers[l] == nullptr) {
+						_layers[l] = new uint16_t[_cells]();
+					}
+
+					_layer_users[l]++;
+				}
+			}
+
+			if (gained & (1 << LAYER_LIFETIME)) {
+				jcanvas::jpoint_t<int> position = Position(index);
+				CellRandom rng = Random(position.x, position.y, RANDOM_LIFETIME);
+
+				// a memoryless lifetime is drawn once, as the update at which a roll of 1/_lifetime at
+				// every update would have succeeded
+				if (_memoryless[type] == true) {
+					float u = 1.0f - rng.NextFloat();
+
+					_layers[LAYER_LIFETIME][index] = std::min(65535.0f, 1.0f + floorf(logf(u)/log1pf(-1.0f/_lifetime[type])));
+				} else {
+					_layers[LAYER_LIFETIME][index] = _lifetime[type]/2 + rng.Next() % _lifetime[type];
+				}
+			}
+		}
+
+		inline void ReleaseLayers()
+		{
+			for (int l=0; l<LAYER_COUNT; l++) {
+				if (_layer_users[l] == 0 && _layers[l] != nullptr) {
+					delete [] _layers[l];
+
+					_layers[l] = nullptr;
+				}
+			}
+		}
+
+		// Counting down the lifetime of a cell, true when it is over
+		inline bool Age(int index)
+		{
+			uint16_t &lifetime = _layers[LAYER_LIFETIME][index];
+
+			if (lifetime > 0) {
+				lifetime--;
+			}
+
+			return lifetime == 0;
+		}
+
+		// Finding the root of the conductive network of a cell (union-find with path halving)
+		inline int FindConductor(int index)
+		{
+			while (_conductor[index] != index) {
+				_conductor[index] = _conductor[_conductor[index]];
+				index = _conductor[index];
+			}
+
+			return index;
+		}
+
+		// The spark a network holds, or 0 when it is over
+		inline uint32_t LiveSpark(int root)
+		{
+			uint32_t stamp = _energized[root];
+
+			return (stamp != 0 && (uint32_t)_tick - stamp < ELEC_DURATION)?stamp:0;
+		}
+
+		// Joining two networks, which keeps the most recent spark of both
+		inline void JoinConductors(int a, int b)
+		{
+			a = FindConductor(a);
+			b = FindConductor(b);
+
+			if (a != b) {
+				_energized[std::min(a, b)] = std::max(LiveSpark(a), LiveSpark(b));
+				_conductor[std::max(a, b)] = std::min(a, b);
+			}
+		}
+
+		// Union-find can't split a network when a conductor goes away, so the removed conductors keep
+		// their links until the networks they belonged to are relabelled, at most once per tick and only
+		// while a spark is alive. Every piece left of such a network touches one of the removed cells, so
+		// only the pieces around them are flooded again, and each piece keeps the spark of its old network
+		void RelinkConductors()
+		{
+			std::vector<int> 
+        unlinked;
+
+			_relabel_seeds.clear();
+
+			for (int index=_unlinked->Next(0, _cells); index >= 0; index=_unlinked->Next(index + 1, _cells)) {
+				int 
+          neighbours[5] = {index, Neighbour(index, 0, -1), Neighbour(index, 0, 1), Neighbour(index, -1, 0), Neighbour(index, 1, 0)};
+
+				for (int i=0; i<5; i++) {
+					int n = neighbours[i];
+
+					if (_conductive[_vs[n]] == true && _conductor[n] >= 0) {
+						_relabel_seeds.emplace_back(n, LiveSpark(FindConductor(n)));
+					}
+				}
+
+				unlinked.push_back(index);
+			}
+
+			// the old links are only followed above, so the removed cells can leave their networks now
+			for (int index : unlinked) {
+				_unlinked->Reset(index);
+
+				if (_conductive[_vs[index]] == false) {
+					_conductor[index] = -1;
+				}
+			}
+
+			_relabel_pass++;
+
+			for (auto &seed : _relabel_seeds) {
+				int root = seed.first;
+
+				if (_relabelled[root] == _relabel_pass) {
+					continue;
+				}
+
+				_relabelled[root] = _relabel_pass;
+				_energized[root] = seed.second;
+				_relabel_queue.assign(1, root);
+
+				while (_relabel_queue.empty() == false) {
+					int index = _relabel_queue.back();
+
+					_relabel_queue.pop_back();
+					_conductor[index] = root;
+
+					int 
+            neighbours[4] = {Neighbour(index, 0, -1), Neighbour(index, 0, 1), Neighbour(index, -1, 0), Neighbour(index, 1, 0)};
+
+					for (int i=0; i<4; i++) {
+						int n = neighbours[i];
+
+						if (_conductive[_vs[n]] == true && _relabelled[n] != _relabel_pass) {
+							_relabelled[n] = _relabel_pass;
+							_relabel_queue.push_back(n);
+						}
+					}
+				}
+			}
+
+			_conduction_dirty = false;
+		}
+
+		inline bool IsSparkAlive()
+		{
+			return _last_spark != 0 && _tick - _last_spark < ELEC_DURATION;
+		}
+
+		// Accounting a conductor that appeared or went away. A conductor that went away keeps its link,
+		// so the cells linked through it still find their root until its network is relabelled
+		inline void ConductorChanged(int index, bool conductive)
+		{
+			if (conductive == false) {
+				_unlinked->Set(index);
+				_conduction_dirty = true;
+
+				return;
+			}
+
+			if (_conductor[index] < 0) {
+				_conductor[index] = index;
+				_energized[index] = 0;
+			}
+
+			int 
+        neighbours[4] = {Neighbour(index, 0, -1), Neighbour(index, 0, 1), Neighbour(index, -1, 0), Neighbour(index, 1, 0)};
+
+			for (int i=0; i<4; i++) {
+				int n = neighbours[i];
+
+				if (_conductive[_vs[n]] == true && _conductor[n] >= 0) {
+					JoinConductors(index, n);
+				}
+			}
+		}
+
+		// A spark energizes the whole network of a conductor at once. The networks are relinked at the
+		// start of the ticks that have a spark alive, so only the first spark after a quiet period finds
+		// them outdated
+		void Energize(int index)
+		{
+			if (_conduction_dirty == true && IsSparkAlive() == false) {
+				RelinkConductors();
+			}
+
+			_energized[FindConductor(index)] = (uint32_t)_tick;
+			_last_spark = _tick;
+		}
+
+		inline bool IsEnergized(int index)
+		{
+			if (_conductive[_vs[index]] == false || IsSparkAlive() == false) {
+				return false;
+			}
+
+			return LiveSpark(FindConductor(index)) != 0;
+		}
+
+		// Initializing the heat sources, which hold their temperature at every tick
+		void initHeat()
+		{
+			std::fill(_heat_source, _heat_source + PARTICLETYPE_ENUM_LENGTH, 0.0f);
+
+			_heat_source[JPT_TORCH] = 600.0f;
+			_heat_source[JPT_STOVE] = 300.0f;
+			_heat_source[JPT_EMBER] = 400.0f;
+			_heat_source[JPT_FIRE] = 600.0f;
+			_heat_source[JPT_MOVEDFIRE] = 600.0f;
+		}
+
+		// Index of (x, y) in the heat grid
+		inline int HeatIndex(int x, int y)
+		{
+			return (x + 1) + ((y + 1)*_heat_stride);
+		}
+
+		// Diffusing the heat with a 5 point stencil and cooling it down towards the ambient
+		// temperature. The stencil doesn't look at the particles at all, so the whole grid is
+		// streamed through the SIMD lanes of the kernels of the cpu
+		void DiffuseHeat()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+				kernels->diffuse_row(_heat_next + HeatIndex(0, y), _heat + HeatIndex(0, y - 1), _heat + HeatIndex(0, y), _heat + HeatIndex(0, y + 1), size.x);
+			}
+
+			std::swap(_heat, _heat_next);
+		}
+
+		// Coupling the heat field with the particles: sources hold their temperature, ice keeps itself
+		// cold and the phase changes happen when a cell crosses its threshold. Only occupied cells
+		// are visited
+		void ApplyHeat()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+				for (int x=NextInRow(_occupancy, 0, size.x, y); x>=0; x=NextInRow(_occupancy, x + 1, size.x, y)) {
+					int index = Index(x, y);
+					jparticle_type_t type = _vs[index];
+					float &t = _heat[HeatIndex(x, y)];
+
+					if (_heat_source[type] != 0.0f) {
+						t = _heat_source[type];
+
+						continue;
+					}
+
+					switch (type) {
+						case JPT_ICE:
+							t = t + 0.5f*(HEAT_ICE - t);
+
+							if (t > HEAT_ICE_MELTING) { // Let the snowman melt!
+								React(index, JPT_WATER);
+							}
+
+							break;
+						case JPT_WATER:
+						case JPT_MOVEDWATER:
+							if (t > HEAT_WATER_BOILING) { // Boil the water
+								React(index, JPT_STEAM);
+							}
+
+							break;
+						case JPT_SALTWATER:
+						case JPT_MOVEDSALTWATER:
+							if (t > HEAT_WATER_BOILING) { // Saltwater separates
+								React(index, JPT_SALT);
+
+								if (_vs[Index(x, y - 1)] == JPT_NOTHING) {
+									React(Index(x, y - 1), JPT_STEAM);
+								}
+							}
+
+							break;
+						case JPT_OIL:
+						case JPT_MOVEDOIL:
+							if (t > HEAT_OIL_IGNITION) { // Set oil aflame
+								React(index, JPT_FIRE);
+							}
+
+							break;
+						default:
+							break;
+					}
+				}
+			}
+		}
+
+		// Initializing the transition table of the Margolus engine. Every entry maps the classes of
+		// the 4 cells of a block (top left, top right, bottom left, bottom right) to a permutation of
+		// these cells, with 2 bits per destination holding the source cell. The variant 1 mirrors the
+		// preferred direction of the diagonal moves
+		void initMargolusRules()
+		{
+			memset(_margolus_class, JMC_SOLID, sizeof(_margolus_class));
+			memset(_margolus_decay, 0, sizeof(_margolus_decay));
+
+			_margolus_class[JPT_NOTHING] = JMC_EMPTY;
+
+			for (int t=JPT_WATER; t<PARTICLETYPE_ENUM_LENGTH; t++) {
+				jparticle_type_t base = (jparticle_type_t)(t & ~1);
+
+				if (IsFloating(base) || base == JPT_ELEC) {
+					_margolus_class[t] = JMC_GAS;
+				} else if (base == JPT_WATER || base == JPT_SALTWATER || base == JPT_OIL || base == JPT_ACID) {
+					_margolus_class[t] = JMC_LIQUID;
+				} else {
+					_margolus_class[t] = JMC_POWDER;
+				}
+			}
+
+			// probability (in 1/65536) of a gas fading away at each tick
+			_margolus_decay[JPT_FIRE] = _margolus_decay[JPT_MOVEDFIRE] = 65536/10;
+			_margolus_decay[JPT_STEAM] = _margolus_decay[JPT_MOVEDSTEAM] = 65536/500;
+			_margolus_decay[JPT_ELEC] = _margolus_decay[JPT_MOVEDELEC] = 65536/2;
+
+			for (int variant=0; variant<2; variant++) {
+				for (int state=0; state<MARGOLUS_STATES; state++) {
+					int c[4] = {state/125, (state/25)%5, (state/5)%5, state%5};
+					int p[4] = {0, 1, 2, 3};
+					bool moved = false;
+
+					auto density = [&](int i) { return c[p[i]]; };
+					auto movable = [&](int i) { return c[p[i]] != JMC_SOLID; };
+
+					// Gravity (and buoyancy of the gases) in both columns
+					for (int col=0; col<2; col++) {
+						if (movable(col) && movable(col + 2) && density(col) > density(col + 2)) {
+							std::swap(p[col], p[col + 2]);
+							moved = true;
+						}
+					}
+
+					// A top cell that can't fall straight slides to the lighter diagonal
+					for (int k=0; k<2 && moved == false; k++) {
+						int col = (variant == 0)?k:1 - k;
+						int top = col;
+						int below = col + 2;
+						int diagonal = (1 - col) + 2;
+
+						if (movable(top) && movable(diagonal) && density(top) > density(diagonal) && (!movable(below) || density(below) >= density(top))) {
+							std::swap(p[top], p[diagonal]);
+							moved = true;
+						}
+					}
+
+					// Liquids spread sideways over lighter cells
+					for (int row=2; row>=0 && moved == false; row-=2) {
+						int a = row + variant;
+						int b = row + 1 - variant;
+
+						if (density(a) == JMC_LIQUID && movable(b) && density(b) < JMC_LIQUID) {
+							std::swap(p[a], p[b]);
+							moved = true;
+						} else if (density(b) == JMC_LIQUID && movable(a) && density(a) < JMC_LIQUID) {
+							std::swap(p[a], p[b]);
+							moved = true;
+						}
+					}
+
+					_margolus_rules[variant][state] = p[0] | (p[1] << 2) | (p[2] << 4) | (p[3] << 6);
+				}
+			}
+		}
+
+		//Checks wether one of the four neighbours of a cell has a given reactivity class
+		bool HasNeighbour(int index, uint8_t mask)
+		{
+			int 
+        neighbours[4] = {Neighbour(index, 0, -1), Neighbour(index, 0, 1), Neighbour(index, -1, 0), Neighbour(index, 1, 0)};
+
+			for (int i=0; i<4; i++) {
+				int n = neighbours[i];
+
+				if ((_reactivity[_vs[n]] & mask) != 0) {
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		//Checks wether the stillborn particle at index has something to do
+		bool IsReactive(int index)
+		{
+			uint8_t r = _reactivity[_vs[index]];
+
+			if (r & REACTIVE_ALWAYS) {
+				return true;
+			}
+
+			if (r & REACTIVE_NEAR_WATER) {
+				return HasNeighbour(index, TRIGGERS_NEAR_WATER);
+			}
+
+			if (r & REACTIVE_NEAR_RUST) {
+				return HasNeighbour(index, TRIGGERS_NEAR_RUST);
+			}
+
+			return false;
+		}
+
+		void MarkActive(int index)
+		{
+			if (_active_mark[index] == 0) {
+				_active_mark[index] = 1;
+				_active.push_back(index);
+			}
+		}
+
+		// Putting a settled particle to sleep. It leaves the motion bitset until one of its neighbours
+		// changes (see ParticleChanged)
+		inline void Sleep(int index)
+		{
+			_motion->Reset(index);
+			_sleep->Set(index);
+			_sleepers++;
+		}
+
+		inline void WakeNeighbours(int index)
+		{
+			int 
+        neighbours[8] = {
+          Neighbour(index, -1, -1), Neighbour(index, 0, -1), Neighbour(index, 1, -1), Neighbour(index, -1, 0), 
+          Neighbour(index, 1, 0), Neighbour(index, -1, 1), Neighbour(index, 0, 1), Neighbour(index, 1, 1)
+        };
+
+			for (int i=0; i<8; i++) {
+				int n = neighbours[i];
+
+				if (_sleep->Test(n)) {
+					_sleep->Reset(n);
+					_motion->Set(n);
+					_sleepers--;
+				}
+			}
+		}
+
+		// Checks wether a liquid that can't move has nothing around that would make it act, i.e. it
+		// is surrounded by the same liquid or walls and has only air above
+		bool IsSettled(int x, int y, jparticle_type_t type)
+		{
+			int 
+        neighbours[3] = {Index(x - 1, y), Index(x + 1, y), Index(x, y + 1)};
+			jparticle_type_t 
+        above = _vs[Index(x, y - 1)];
+
+			if (above != JPT_NOTHING && (above & ~1) != type && above != JPT_WALL && above != JPT_BORDER) {
+				return false;
+			}
+
+			for (int i=0; i<3; i++) {
+				jparticle_type_t n = _vs[neighbours[i]];
+
+				if ((n & ~1) != type && n != JPT_WALL && n != JPT_BORDER) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		// Looking for the farthest free cell a particle can reach along its row in a given direction,
+		// stopping early where it would fall down
+		inline int FindDispersionSlot(int x, int y, int direction, int reach)
+		{
+			int 
+        slot = -1;
+
+			// the sentinels stop the scan at the sides of the screen
+			for (int k=1; k<=reach; k++) {
+				int index = Index(x + direction*k, y);
+
+				if (_vs[index] != JPT_NOTHING) {
+					break;
+				}
+
+				slot = index;
+
+				if (_vs[Index(x + direction*k, y + 1)] == JPT_NOTHING) {
+					break;
+				}
+			}
+
+			return slot;
+		}
+
+		// Every write to the virtual screen goes through here, so the occupancy bitsets and the active
+		// list stay in sync with the grid
+		inline void SetParticle(int index, jparticle_type_t type)
+		{
+			jparticle_type_t 
+        old = _vs[index];
+
+			_vs[index] = type;
+
+			ParticleChanged(index, old, type);
+		}
+
+		// The writes of a material turning into another (burning, melting, dissolving, ...) instead of
+		// moving. With JSAND_REACTION_COUNTERS they are counted by pair of materials at rest, otherwise
+		// it is only SetParticle()
+		inline void React(int index, jparticle_type_t type)
+		{
+#ifdef JSAND_REACTION_COUNTERS
+			int from = _vs[index];
+			int to = type;
+
+			if (from >= JPT_WATER && (from % 2) != 0) {
+				from = from - 1;
+			}
+
+			if (to >= JPT_WATER && (to % 2) != 0) {
+				to = to - 1;
+			}
+
+			if (from != to) {
+				_reactions[from*PARTICLETYPE_ENUM_LENGTH + to]++;
+			}
+#endif
+
+			SetParticle(index, type);
+		}
+
+		// Moving the particle of 'from' to 'to' as 'type', along with its layers, and emptying 'from'
+		inline void MoveCell(int from, int to, jparticle_type_t type)
+		{
+			SetParticle(to, type);
+
+			if (_layered[type] != 0) {
+				for (int l=0; l<LAYER_COUNT; l++) {
+					if (_layered[type] & (1 << l)) {
+						_layers[l][to] = _layers[l][from];
+					}
+				}
+			}
+
+			SetParticle(from, JPT_NOTHING);
+		}
+
+		// Moving the particle of 'other' to 'index' and the one of 'index' to 'other' as 'type', along
+		// with their layers
+		inline void SwapCells(int index, int other, jparticle_type_t type)
+		{
+			jparticle_type_t 
+        moved = _vs[other];
+			uint8_t 
+        layered = _layered[moved] | _layered[type];
+
+			if (layered == 0) {
+				SetParticle(index, moved);
+				SetParticle(other, type);
+
+				return;
+			}
+
+			uint16_t values[LAYER_COUNT][2] = {};
+
+			for (int l=0; l<LAYER_COUNT; l++) {
+				if (layered & (1 << l)) {
+					values[l][0] = _layers[l][index];
+					values[l][1] = _layers[l][other];
+				}
+			}
+
+			SetParticle(index, moved);
+			SetParticle(other, type);
+
+			for (int l=0; l<LAYER_COUNT; l++) {
+				if (_layered[moved] & (1 << l)) {
+					_layers[l][index] = values[l][1];
+				}
+
+				if (_layered[type] & (1 << l)) {
+					_layers[l][other] = values[l][0];
+				}
+			}
+		}
+
+		// Bookkeeping of a cell that went from 'old' to 'type'. Entries of the active list are removed
+		// lazily in UpdateActiveParticles() once the cell stops reacting
+		inline void ParticleChanged(int index, jparticle_type_t old, jparticle_type_t type)
+		{
+			// clearing the moved flag doesn't change the color of the cell
+			if (!(old == type + 1 && type % 2 == 0 && IsMoving(type))) {
+				_damage->Set(index >> DAMAGE_SHIFT);
+			}
+
+			if (_sleepers > 0) {
+				if (_sleep->Test(index)) {
+					_sleep->Reset(index);
+					_sleepers--;
+
+					if (IsMoving(type)) {
+						_motion->Set(index);
+					}
+				}
+
+				// clearing the moved flag doesn't disturb the neighbours
+				if (!(IsMoving(old) && IsMoving(type) && (old & ~1) == (type & ~1))) {
+					WakeNeighbours(index);
+				}
+			}
+
+			if (_conductive[old] != _conductive[type]) {
+				ConductorChanged(index, _conductive[type]);
+			}
+
+			if (_layered[old] != _layered[type]) {
+				LayersChanged(index, old, type);
+			}
+
+			if (_decay[old] != _decay[type]) {
+				DecayChanged(index, type);
+			}
+
+			if ((old == JPT_NOTHING) != (type == JPT_NOTHING)) {
+				if (type == JPT_NOTHING) {
+					_occupancy->Reset(index);
+				} else {
+					_occupancy->Set(index);
+				}
+			}
+
+			if (IsMoving(old) != IsMoving(type)) {
+				if (IsMoving(type)) {
+					_motion->Set(index);
+					_particle_count++;
+				} else {
+					_motion->Reset(index);
+					_particle_count--;
+				}
+			}
+
+			uint8_t r = _reactivity[type];
+
+			if (r == 0 && _reactivity[old] == 0) {
+				return;
+			}
+
+			if (r & REACTIVE_ALWAYS) {
+				MarkActive(index);
+			} else if (r & (REACTIVE_NEAR_WATER | REACTIVE_NEAR_RUST)) {
+				if (IsReactive(index)) {
+					MarkActive(index);
+				}
+			}
+
+			// A new water or rust cell can wake up a neighbouring plant or iron wall
+			uint8_t triggers = (r & ~_reactivity[old]) & (TRIGGERS_NEAR_WATER | TRIGGERS_NEAR_RUST);
+
+			if (triggers != 0) {
+				uint8_t woken = ((triggers & TRIGGERS_NEAR_WATER)?REACTIVE_NEAR_WATER:0) | ((triggers & TRIGGERS_NEAR_RUST)?REACTIVE_NEAR_RUST:0);
+
+				int 
+          neighbours[4] = {Neighbour(index, 0, -1), Neighbour(index, 0, 1), Neighbour(index, -1, 0), Neighbour(index, 1, 0)};
+
+				for (int i=0; i<4; i++) {
+					int n = neighbours[i];
+
+					if ((_reactivity[_vs[n]] & woken) != 0) {
+						MarkActive(n);
+					}
+				}
+			}
+		}
+
+		// Emitting a given particletype at (x,o) width pixels wide and
+		// with a p density (probability that a given pixel will be drawn 
+		// at a given position withing the width)
+		void Emit(int x, int width, jparticle_type_t type, float p)
+		{
+			for (int i=x-width/2; i<x+width/2; i++) {
+				if (Random(i, 1, RANDOM_EMIT).NextFloat() < p) {
+					SetParticle(Index(i, 1), type);
+				}
+			}
+		}
+
+		void StillbornParticleLogic(int x,int y,jparticle_type_t type)
+		{
+			int 
+        index, 
+        above, 
+        left, 
+        right, 
+        below, 
+        same;
+			CellRandom 
+        rng = Random(x, y, RANDOM_STILLBORN);
+
+			switch (type) {
+				case JPT_VOID:
+					above = Index(x, y - 1);
+					left = Index(x + 1, y);
+					right = Index(x - 1, y);
+					below = Index(x, y + 1);
+
+					if (_vs[above] != JPT_NOTHING && _vs[above] != JPT_BORDER) {
+						React(above, JPT_NOTHING);
+					}
+
+					if (_vs[below] != JPT_NOTHING && _vs[below] != JPT_BORDER) {
+						React(below, JPT_NOTHING);
+					}
+
+					if (_vs[left] != JPT_NOTHING && _vs[left] != JPT_BORDER) {
+						React(left, JPT_NOTHING);
+					}
+
+					if (_vs[right] != JPT_NOTHING && _vs[right] != JPT_BORDER) {
+						React(right, JPT_NOTHING);
+					}
+
+					break;
+				case JPT_IRONWALL:
+					above = Index(x, y - 1);
+					left = Index(x + 1, y);
+					right = Index(x - 1, y);
+
+					if (rng.Next()%200 == 0 && (_vs[above] == JPT_RUST || _vs[left] == JPT_RUST || _vs[right] == JPT_RUST)) {
+						React(Index(x, y), JPT_RUST);
+					}
+
+					break;
+				case JPT_TORCH:
+					above = Index(x, y - 1);
+					left = Index(x + 1, y);
+					right = Index(x - 1, y);
+
+					if (rng.Next()%2 == 0) { // Spawns fire
+						if (_vs[above] == JPT_NOTHING || _vs[above] == JPT_MOVEDFIRE) { //Fire above
+							React(above, JPT_MOVEDFIRE);
+						}
+
+						if (_vs[right] == JPT_NOTHING || _vs[right] == JPT_MOVEDFIRE) { //Fire to the right
+							React(right, JPT_MOVEDFIRE);
+						}
+
+						if (_vs[left] == JPT_NOTHING || _vs[left] == JPT_MOVEDFIRE) { //Fire to the left
+							React(left, JPT_MOVEDFIRE);
+						}
+					}
+
+					break;
+				case JPT_PLANT:
+					if (rng.Next()%2 == 0) { //Making the plant grow _slowly
+						index = 0;
+
+						switch (rng.Next()%4) {
+							case 0: index = Index(x - 1, y); break;
+							case 1: index = Index(x, y - 1); break;
+							case 2: index = Index(x + 1, y); break;
+							case 3:	index = Index(x, y + 1); break;
+						}
+
+						if (_vs[index] == JPT_WATER) {
+							React(index, JPT_PLANT);
+						}
+					}
+					break;
+				case JPT_EMBER:
+					below = Index(x, y + 1);
+
+					if (_vs[below] == JPT_NOTHING || IsBurnable(_vs[below])) {
+						React(below, JPT_FIRE);
+					}
+
+					index = 0;
+
+					switch (rng.Next()%4) {
+						case 0: index = Index(x - 1, y); break;
+						case 1: index = Index(x, y - 1); break;
+						case 2: index = Index(x + 1, y); break;
+						case 3:	index = Index(x, y + 1); break;
+					}
+
+					if (_vs[index] == JPT_PLANT) {
+						React(index, JPT_FIRE);
+					}
+
+					if (Age(Index(x, y)) == true) { // Making ember burn out _slowly
+						React(Index(x, y), JPT_NOTHING);
+					}
+
+					break;
+
+					//####################### SPOUTS ####################### 
+				case JPT_WATERSPOUT:
+					if (rng.Next()%6 == 0) { // Take it easy on the spout
+						below = Index(x, y + 1);
+
+						if (_vs[below] == JPT_NOTHING) {
+							React(below, JPT_MOVEDWATER);
+						}
+					}
+
+					break;
+				case JPT_SANDSPOUT:
+					if (rng.Next()%6 == 0) { // Take it easy on the spout
+						below = Index(x, y + 1);
+
+						if (_vs[below] == JPT_NOTHING) {
+							React(below, JPT_MOVEDSAND);
+						}
+					}
+
+					break;
+				case JPT_SALTSPOUT:
+					if (rng.Next()%6 == 0) { // Take it easy on the spout
+						below = Index(x, y + 1);
+
+						if (_vs[below] == JPT_NOTHING) {
+							React(below, JPT_MOVEDSALT);
+						}
+
+						if (_vs[below] == JPT_WATER || _vs[below] == JPT_MOVEDWATER) {
+							React(below, JPT_MOVEDSALTWATER);
+						}
+					}
+
+					break;
+				case JPT_OILSPOUT:
+					if (rng.Next()%6 == 0) { // Take it easy on the spout
+						below = Index(x, y + 1);
+
+						if (_vs[below] == JPT_NOTHING) {
+							React(below, JPT_MOVEDOIL);
+						}
+					}
+
+					break;
+				default:
+					break;
+			}
+		}
+
+		// Performing the movement logic of a particle. There is one kernel per material, instantiated
+		// with its MOVED type, so the checks that don't apply to the material are discarded at compile
+		// time and the kernel is straight-line code. The kernels are dispatched by UpdateVirtualPixel()
+		// through the table filled by initKernels()
+		template <jparticle_type_t type>
+		void MoveKernel(int x, int y, CellRandom &rng)
+		{
+			typedef jparticle_traits_t<type> traits;
+
+			int above = Index(x, y - 1);
+			int same = Index(x, y);
+			int below = Index(x, y + 1);
+
+			// If nothing below then just fall (gravity)
+			if constexpr (!traits::floating) {
+				if ( (_vs[below] == JPT_NOTHING) && (rng.Next() % 8)) { //rng.Next() % 8 makes it spread
+					MoveCell(same, below, type);
+					return;
+				}
+			} else {
+				if (rng.Next()%3 == 0) { //Slow _is_button_down please
+					return;
+				}
+
+				//If nothing above then rise (floating - or reverse gravity? ;))
+				if ((_vs[above] == JPT_NOTHING || _vs[above] == JPT_FIRE) && (rng.Next() % 8)) { //rng.Next() % 8 makes it spread
+					if (type == JPT_MOVEDFIRE && Age(same) == true) {
+						React(same, JPT_NOTHING);
+					} else {
+						MoveCell(same, above, _vs[same]);
+					}
+
+					return;
+				}
+			}
+
+			//Randomly select right or left first
+			int sign = (rng.Next() % 2 == 0)?-1:1;
+
+			// We'll only calculate these indicies once for optimization purpose
+			int first = Index(x + sign, y);
+			int second = Index(x - sign, y);
+			int index = 0;
+
+			//Particle type specific logic
+			if constexpr (type == JPT_MOVEDELEC) {
+				// Electricity is drained by the first conductor it touches
+				index = -1;
+
+				if (_conductive[_vs[below]]) {
+					index = below;
+				} else if (_conductive[_vs[first]]) {
+					index = first;
+				} else if (_conductive[_vs[second]]) {
+					index = second;
+				} else if (_conductive[_vs[above]]) {
+					index = above;
+				}
+
+				if (index >= 0) {
+					Energize(index);
+					React(same, JPT_NOTHING);
+
+					return;
+				}
+
+				if (rng.Next()%2 == 0) {
+					React(same, JPT_NOTHING);
+				}
+			} else if constexpr (type == JPT_MOVEDSTEAM) {
+				// the steam that outlived its lifetime condenses in a third of the cases, and vanishes
+				// otherwise
+				if (Age(same) == true) {
+					React(same, (rng.Next()%3 == 0)?JPT_MOVEDWATER:JPT_NOTHING);
+
+					return;
+				}
+
+				if (!IsStillborn(_vs[above]) && !IsFloating(_vs[above])) {
+					if (rng.Next()%15 == 0) {
+						React(same, JPT_NOTHING);
+
+						return;
+					} else {
+						SwapCells(same, above, JPT_MOVEDSTEAM);
+
+						return;
+					}
+				}
+			} else if constexpr (type == JPT_MOVEDFIRE) {
+				if (!IsBurnable(_vs[above]) && rng.Next()%10 == 0) {
+					React(same, JPT_NOTHING);
+
+					return;
+				}
+
+				//Let's burn whatever we can!
+				index = RandomNeighbour(rng, above, below, first, second);
+
+				if (IsBurnable(_vs[index])) {
+					if (BurnsAsEmber(_vs[index])) {
+						React(index, JPT_EMBER);
+					} else {
+						React(index, JPT_FIRE);
+					}
+				}
+			} else if constexpr (type == JPT_MOVEDWATER) {
+				if (rng.Next()%200 == 0 && _vs[below] == JPT_IRONWALL) {
+					React(below, JPT_RUST);
+				}
+
+				//Making water+dirt into dirt
+				if (_vs[below] == JPT_DIRT) {
+					React(below, JPT_MOVEDMUD);
+					React(same, JPT_NOTHING);
+				}
+
+				if (_vs[above] == JPT_DIRT) {
+					React(above, JPT_MOVEDMUD);
+					React(same, JPT_NOTHING);
+				}
+
+				//Making water+salt into saltwater
+				if (_vs[above] == JPT_SALT || _vs[above] == JPT_MOVEDSALT) {
+					React(above, JPT_MOVEDSALTWATER);
+					React(same, JPT_NOTHING);
+				}
+
+				if (_vs[below] == JPT_SALT || _vs[below] == JPT_MOVEDSALT) {
+					React(below, JPT_MOVEDSALTWATER);
+					React(same, JPT_NOTHING);
+				}
+
+				if (rng.Next()%60 == 0) { //Melting ice
+					index = RandomNeighbour(rng, above, below, first, second);
+
+					if (_vs[index] == JPT_ICE) {
+						React(index, JPT_WATER);
+					}
+				}
+			} else if constexpr (type == JPT_MOVEDACID) {
+				index = RandomNeighbour(rng, above, below, first, second);
+
+				if (_vs[index] != JPT_WALL && _vs[index] != JPT_BORDER && _vs[index] != JPT_IRONWALL && _vs[index] != JPT_WATER && _vs[index] != JPT_MOVEDWATER && _vs[index] != JPT_ACID && _vs[index] != JPT_MOVEDACID) {
+					React(index, JPT_NOTHING);
+				}
+			} else if constexpr (type == JPT_MOVEDSALT) {
+				if (rng.Next()%20 == 0) {
+					index = RandomNeighbour(rng, above, below, first, second);
+
+					if (_vs[index] == JPT_ICE) {
+						React(index, JPT_WATER);
+					}
+				}
+			} else if constexpr (type == JPT_MOVEDSALTWATER) {
+				//Saltwater separated by heat
+				//	if (_vs[above] == FIRE || _vs[below] == FIRE || _vs[first] == FIRE || _vs[second] == FIRE || _vs[above] == STOVE || _vs[below] == STOVE || _vs[first] == STOVE || _vs[second] == STOVE)
+				//	{
+				//		_vs[same] = SALT;
+				//		_vs[above] = STEAM;
+				//	}
+				if (rng.Next()%40 == 0) { //Saltwater dissolves ice more _slowly than pure salt
+					index = RandomNeighbour(rng, above, below, first, second);
+
+					if (_vs[index] == JPT_ICE) {
+						React(index, JPT_WATER);
+					}
+				}
+			} else if constexpr (type == JPT_MOVEDOIL) {
+				index = RandomNeighbour(rng, above, below, first, second);
+
+				if (_vs[index] == JPT_FIRE || IsEnergized(index)) {
+					React(same, JPT_FIRE);
+				}
+			}
+
+			//Peform 'realism' logic?
+			// When adding dynamics to this part please use the following structure:
+			// If a particle A is ligther than particle B then add _vs[above] == B to the condition in case A (case MOVED_A)
+			if constexpr (traits::swaps) {
+				if (_implement_particle_swaps) {
+					bool lighter = false;
+
+					if constexpr (type == JPT_MOVEDWATER) {
+						lighter = (_vs[above] == JPT_SAND || _vs[above] == JPT_MUD || _vs[above] == JPT_SALTWATER && rng.Next()%3 == 0);
+					} else if constexpr (type == JPT_MOVEDOIL) {
+						lighter = (_vs[above] == JPT_WATER && rng.Next()%3 == 0);
+					} else if constexpr (type == JPT_MOVEDSALTWATER) {
+						lighter = (_vs[above] == JPT_DIRT || _vs[above] == JPT_MUD || _vs[above] == JPT_SAND && rng.Next()%3 == 0);
+					}
+
+					if (lighter) {
+						SwapCells(same, above, type);
+
+						return;
+					}
+				}
+			}
+
+			// The place below (x,y+1) is filled with something, then check (x+sign,y+1) and (x-sign,y+1).
+			// We chose sign randomly to randomly check eigther left or right. This is for elements that fall _is_button_downward
+			if constexpr (!traits::floating) {
+				int first_is_button_down = Index(x + sign, y + 1);
+				int second_is_button_down = Index(x - sign, y + 1);
+
+				if ( _vs[first_is_button_down] == JPT_NOTHING) {
+					MoveCell(same, first_is_button_down, type);
+				} else if ( _vs[second_is_button_down] == JPT_NOTHING) {
+					MoveCell(same, second_is_button_down, type);
+				} else {
+					// Liquids scan up to _dispersion[type] cells along the row for a free slot
+					int slot = FindDispersionSlot(x, y, sign, _dispersion[type]);
+
+					if (slot < 0) {
+						slot = FindDispersionSlot(x, y, -sign, _dispersion[type]);
+					}
+
+					if (slot >= 0) {
+						MoveCell(same, slot, type);
+					} else if (_dispersion[type] > 1 && _vs[same] == type - 1 && IsSettled(x, y, (jparticle_type_t)(type - 1))) {
+						Sleep(same);
+					}
+				}
+			} else if constexpr (type == JPT_MOVEDSTEAM) {
+				// Make steam move
+				int firstup = Index(x + sign, y - 1);
+				int secondup = Index(x - sign, y - 1);
+
+				if ( _vs[firstup] == JPT_NOTHING) {
+					MoveCell(same, firstup, type);
+				} else if ( _vs[secondup] == JPT_NOTHING) {
+					MoveCell(same, secondup, type);
+				} else if (_vs[first] == JPT_NOTHING) {
+					MoveCell(same, first, type);
+				} else if (_vs[second] == JPT_NOTHING) {
+					MoveCell(same, second, type);
+				}
+			}
+		}
+
+		//Drawing a filled circle at a given position with a given radius and a given partice type
+		void DrawParticles(int xpos, int ypos, int radius, jparticle_type_t type)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			for (int x=((xpos-radius-1) < 0)?0:(xpos-radius-1); x<=xpos+radius && x<size.x; x++) {
+				for (int y=((ypos-radius-1) < 0)?0:(ypos-radius-1); y<=ypos+radius && y<size.y-DASHBOARD_SIZE; y++) {
+					if ((x - xpos)*(x - xpos) + (y - ypos)*(y - ypos) <= radius*radius) {
+						EditParticle(Index(x, y), type);
+					}
+				}
+			}
+		}
+
+		void DrawLine(int newx, int newy, int _old_x, int _old_y)
+		{
+			if (newx == _old_x && newy == _old_y) {
+				DrawParticles(newx,newy,_pen_size,_current_particle);
+			} else {
+				float step = 1.0f / ((abs(newx-_old_x)>abs(newy-_old_y)) ? abs(newx-_old_x) : abs(newy-_old_y));
+
+				for (float a = 0; a < 1; a+=step) {
+					DrawParticles(a*newx+(1-a)*_old_x,a*newy+(1-a)*_old_y,_pen_size,_current_particle); 
+				}
+			}
+		}
+
+		void DoRandomLines(jparticle_type_t type)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			jparticle_type_t 
+        tmp = _current_particle;
+
+			_current_particle = type;
+
+			for (int i = 0; i < 20; i++) {
+				int x1 = rand() % size.x;
+				int x2 = rand() % size.x;
+
+				DrawLine(x1, 0, x2, size.y);
+			}
+
+			for (int i = 0; i < 20; i++) {
+				int y1 = rand() % size.y;
+				int y2 = rand() % size.y;
+
+				DrawLine(0, y1, size.x, y2);
+			}
+
+			_current_particle = tmp;
+		}
+
+		// The tile of the cost overlay that contains the cell (x, y)
+		inline int CostTile(int x, int y)
+		{
+			return (x/COST_TILE) + (y/COST_TILE)*_cost_columns;
+		}
+
+		inline void CountCost(int x, int y)
+		{
+			_cost_ticks[CostTile(x, y)]++;
+		}
+
+		// Folding the cells updated by the last frame in the cost of the tiles. The average forgets the
+		// old frames, so the overlay follows the activity of the last second or so
+		void AccumulateCost()
+		{
+			for (int i=0; i<_cost_columns*_cost_rows; i++) {
+				_cost[i] = 0.9f*_cost[i] + 0.1f*_cost_ticks[i];
+				_cost_ticks[i] = 0;
+			}
+		}
+
+		inline void UpdateVirtualPixel(int x, int y)
+		{
+			jparticle_type_t 
+        same = _vs[Index(x, y)];
+
+			if (_cost_overlay == true) {
+				CountCost(x, y);
+			}
+
+			// Stillborn particles are handled by UpdateActiveParticles()
+			if (IsMoving(same)) {
+				CellRandom rng = Random(x, y, RANDOM_MOVE);
+
+				if (rng.Next() % 13 != 0 && same % 2 == 0) {
+					(this->*_kernels[same])(x, y, rng); //THe rand condition makes the particles fall unevenly
+				}
+			}
+		}
+
+		// Running the logic of the stillborn particles that can act. The list is walked backwards, so
+		// the swap-remove of stale entries never skips one and particles added by the logic itself
+		// (a growing plant) wait until the next tick
+		inline void UpdateActiveParticles()
+		{
+			for (int i=_active.size(); i--;) {
+				int index = _active[i];
+
+				if (!IsReactive(index)) {
+					_active_mark[index] = 0;
+					_active[i] = _active.back();
+					_active.pop_back();
+
+					continue;
+				}
+
+				jcanvas::jpoint_t<int> position = Position(index);
+
+				if (_cost_overlay == true) {
+					CountCost(position.x, position.y);
+				}
+
+				StillbornParticleLogic(position.x, position.y, _vs[index]);
+			}
+		}
+
+		// Throwing a particle of a moving type from the sub-cell position (x, y). It is integrated by
+		// UpdateFastParticles() until it lands in the grid
+		void ThrowParticle(float x, float y, float vx, float vy, jparticle_type_t type)
+		{
+			if (!IsMoving(type) || _fast.size() >= FAST_LIMIT) {
+				return;
+			}
+
+			_fast.push_back({x, y, vx, vy, (jparticle_type_t)(type & ~1)});
+		}
+
+		// Throwing a burst of particles upwards from the cell (x, y), like an eruption
+		void Erupt(int x, int y, jparticle_type_t type)
+		{
+			for (int i=0; i<FAST_BURST; i++) {
+				float angle = -M_PI/2 + M_PI/2*((float)rand()/RAND_MAX - 0.5f);
+				float speed = 4.0f + rand()%9;
+
+				ThrowParticle(x + 0.5f, y + 0.5f, speed*cosf(angle), speed*sinf(angle), type);
+			}
+		}
+
+		// A free cell around a cell for a particle to be put back in the grid, or -1
+		inline int FreeCellAround(int index)
+		{
+			static const int offsets[8][2] = {{0, -1}, {-1, 0}, {1, 0}, {-1, -1}, {1, -1}, {0, 1}, {-1, 1}, {1, 1}};
+
+			for (int i=0; i<8; i++) {
+				int n = Neighbour(index, offsets[i][0], offsets[i][1]);
+
+				if (_vs[n] == JPT_NOTHING) {
+					return n;
+				}
+			}
+
+			return -1;
+		}
+
+		// Integrating the particles in flight. The path of a tick is marched in steps of at most one
+		// cell along each axis, so no cell is skipped, and the particle stops in the last free cell
+		// before a collision. It is deposited there with the moved flag, so the sweep of this tick
+		// leaves it alone. A particle that starts the tick buried (erupted from inside a material or
+		// covered by the grid meanwhile) keeps flying through the material until it finds a free cell.
+		// If it reaches a border first it is put in a free cell around it, and only lost if there is
+		// none
+		void UpdateFastParticles()
+		{
+			for (int i=_fast.size(); i--;) {
+				jfast_particle_t &p = _fast[i];
+
+				p.vy = p.vy + (IsFloating(p.type)?-0.5f*FAST_GRAVITY:FAST_GRAVITY);
+				p.vx = std::min(FAST_MAXIMUM_SPEED, std::max(-FAST_MAXIMUM_SPEED, p.vx*(1.0f - FAST_DRAG)));
+				p.vy = std::min(FAST_MAXIMUM_SPEED, std::max(-FAST_MAXIMUM_SPEED, p.vy*(1.0f - FAST_DRAG)));
+
+				int last = Index((int)p.x, (int)p.y);
+				int steps = (int)ceilf(std::max(fabsf(p.vx), fabsf(p.vy)));
+				bool buried = (_vs[last] != JPT_NOTHING);
+				bool landed = false;
+				float x = p.x;
+				float y = p.y;
+
+				for (int step=1; step<=steps && landed == false; step++) {
+					float nx = p.x + p.vx*step/steps;
+					float ny = p.y + p.vy*step/steps;
+					int index = Index((int)floorf(nx), (int)floorf(ny));
+
+					if (index == last) {
+						x = nx;
+						y = ny;
+					} else if (_vs[index] == JPT_BORDER || (buried == false && _vs[index] != JPT_NOTHING)) {
+						landed = true;
+					} else {
+						buried = (_vs[index] != JPT_NOTHING);
+						last = index;
+						x = nx;
+						y = ny;
+					}
+				}
+
+				p.x = x;
+				p.y = y;
+
+				if (landed == true || (buried == false && fabsf(p.vx) + fabsf(p.vy) < FAST_REST)) {
+					int cell = (_vs[last] == JPT_NOTHING)?last:FreeCellAround(last);
+
+					if (cell >= 0) {
+						SetParticle(cell, (jparticle_type_t)(p.type + 1));
+					}
+
+					_fast[i] = _fast.back();
+					_fast.pop_back();
+				}
+			}
+		}
+
+		// Drawing the particles in flight over the rendered grid. Their cells are damaged, so the
+		// grid below them is drawn again in the next frame
+		void RenderFastParticles()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			for (const jfast_particle_t &p : _fast) {
+				int x = (int)p.x;
+				int y = (int)p.y;
+
+				_pixels[x + y*size.x] = colors[p.type];
+				_damage->Set(Index(x, y) >> DAMAGE_SHIFT);
+			}
+		}
+
+		// Updating the particle system (virtual screen)
+		inline void UpdateVirtualScreen()
+		{
+			if (_budget_mode == true && _engine == JSE_CELLULAR) {
+				UpdateScheduledScreen();
+
+				return;
+			}
+
+			BeginTick();
+
+			if (_engine == JSE_MARGOLUS) {
+				UpdateMargolusScreen();
+			} else {
+				UpdateCellularScreen();
+			}
+
+			EndTick();
+
+			_lag = 0.0f;
+		}
+
+		// The passes that run once per tick, before and after the sweep of the particles
+		inline void BeginTick()
+		{
+			_tick++;
+
+			if (_conduction_dirty == true && IsSparkAlive() == true) {
+				RelinkConductors();
+			}
+
+			UpdateDecays();
+			DiffuseHeat();
+			ApplyHeat();
+			UpdateActiveParticles();
+
+			if (_fast.empty() == false) {
+				UpdateFastParticles();
+			}
+		}
+
+		inline void EndTick()
+		{
+			if (_level_liquids == true) {
+				LevelLiquids();
+			}
+
+			ReleaseLayers();
+
+#ifdef JSAND_REACTION_COUNTERS
+			CollectReactions();
+#endif
+		}
+
+#ifdef JSAND_REACTION_COUNTERS
+		// Folding the reactions of the tick into the totals and the rates per tick, and appending the
+		// non zero pairs to the stream as 'tick,from,to,count'
+		void CollectReactions()
+		{
+			for (int i=0; i<PARTICLETYPE_ENUM_LENGTH*PARTICLETYPE_ENUM_LENGTH; i++) {
+				uint32_t count = _reactions[i];
+
+				_reaction_rate[i] = 0.95f*_reaction_rate[i] + 0.05f*count;
+
+				if (count == 0) {
+					continue;
+				}
+
+				_reaction_totals[i] += count;
+				_reactions[i] = 0;
+
+				if (_reaction_stream != nullptr) {
+					fprintf(_reaction_stream, "%llu,%s,%s,%u\n", (unsigned long long)_tick, 
+              GetParticleName((jparticle_type_t)(i / PARTICLETYPE_ENUM_LENGTH)).c_str(), GetParticleName((jparticle_type_t)(i % PARTICLETYPE_ENUM_LENGTH)).c_str(), count);
+				}
+			}
+		}
+
+		bool StartReactions(std::string target)
+		{
+			_reaction_stream = fopen(target.c_str(), "w");
+
+			if (_reaction_stream == nullptr) {
+				fprintf(stderr, "reactions: unable to write to %s\n", target.c_str());
+
+				return false;
+			}
+
+			fprintf(_reaction_stream, "tick,from,to,count\n");
+
+			return true;
+		}
+#endif
+
+		// Updating the particle system pixel by pixel, with the variant of the sweep of the selected
+		// instruction set. The variants have the scans of the bitsets and the update of a cell inlined
+		// (flatten), so they run with the instructions of the variant; the move kernels are called
+		// through their table and stay generic
+		inline void UpdateCellularScreen()
+		{
+			switch (kernels->isa) {
+				case JISA_AVX2:
+					return UpdateCellularScreenAvx2();
+				case JISA_AVX512:
+					return UpdateCellularScreenAvx512();
+				default:
+					return UpdateCellularScreenGeneric();
+			}
+		}
+
+		inline void UpdateCellularRow(int y)
+		{
+			switch (kernels->isa) {
+				case JISA_AVX2:
+					return UpdateCellularRowAvx2(y);
+				case JISA_AVX512:
+					return UpdateCellularRowAvx512(y);
+				default:
+					return UpdateCellularRowGeneric(y);
+			}
+		}
+
+		__attribute__((flatten)) void UpdateCellularScreenGeneric()
+		{
+			SweepScreen();
+		}
+
+		__attribute__((target("avx2,bmi,bmi2,lzcnt"), flatten)) void UpdateCellularScreenAvx2()
+		{
+			SweepScreen();
+		}
+
+		__attribute__((target("avx512f,bmi,bmi2,lzcnt"), flatten)) void UpdateCellularScreenAvx512()
+		{
+			SweepScreen();
+		}
+
+		__attribute__((flatten)) void UpdateCellularRowGeneric(int y)
+		{
+			SweepRow(y);
+		}
+
+		__attribute__((target("avx2,bmi,bmi2,lzcnt"), flatten)) void UpdateCellularRowAvx2(int y)
+		{
+			SweepRow(y);
+		}
+
+		__attribute__((target("avx512f,bmi,bmi2,lzcnt"), flatten)) void UpdateCellularRowAvx512(int y)
+		{
+			SweepRow(y);
+		}
+
+		// The screen is swept in the order it is stored, i.e. row by row or tile by tile (one run of
+		// every row of a band of tiles at a time)
+		inline void SweepScreen()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int 
+        rows = size.y - DASHBOARD_SIZE;
+
+#ifdef JSAND_TILED_LAYOUT
+			for (int top=0; top<rows; top=RunEnd(top)) {
+				int bottom = std::min(rows, RunEnd(top));
+
+				for (int x=0; x<size.x; x=RunEnd(x)) {
+					int end = std::min(size.x, RunEnd(x));
+
+					for (int y=top; y<bottom; y++) {
+						UpdateCellularRun(x, end, y);
+					}
+				}
+			}
+#else
+			for (int y =0; y<rows; y++) {
+				UpdateCellularRun(0, size.x, y);
+			}
+#endif
+		}
+
+		inline void SweepRow(int y)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			UpdateCellularRun(0, size.x, y);
+		}
+
+		// Only the cells set in the motion bitset are visited. The bitset is read again after every
+		// update, so particles moved along the scanline are seen the same way the full sweep did
+		inline void UpdateCellularRun(int begin, int end, int y)
+		{
+			if (NextInRow(_motion, begin, end, y) < 0) {
+				return;
+			}
+
+			// Due to biasing when iterating through the scanline from left to right,
+			// we now chose our direction randomly per scanline.
+			if (Random(begin, y, RANDOM_SWEEP).Next() % 2 == 0) {
+				for (int x=PreviousInRow(_motion, begin, end, y); x>=0; x=PreviousInRow(_motion, begin, x, y)) {
+					UpdateVirtualPixel(x, y);
+				}
+			} else {
+				for (int x=NextInRow(_motion, begin, end, y); x>=0; x=NextInRow(_motion, x + 1, end, y)) {
+					UpdateVirtualPixel(x, y);
+				}
+			}
+		}
+
+		// Updating the particle system within the time left in the frame. The rows are processed in
+		// a rotating order and the sweep resumes where it stopped on the next frame; a tick ends when
+		// the rotation wraps. The cost of every row is tracked with a moving average, so the sweep
+		// stops before a row that wouldn't fit. The lag counts the ticks the simulation is behind
+		// real time (one tick per frame) and lets it run extra rows to catch up when there is time
+		void UpdateScheduledScreen()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			std::chrono::steady_clock::time_point 
+        start = std::chrono::steady_clock::now();
+			int 
+        rows = size.y - DASHBOARD_SIZE,
+        limit = (int)(rows*(1.0f + _lag)),
+        done = 0;
+			float 
+        budget = std::max(1.0f, _frame_time - (_paint_time - _update_time));
+
+			while (done < limit) {
+				if (_tick_open == false) {
+					// the frame ended a tick and begins the next one, before the render settles the moved
+					// particles of the last one
+					if (done > 0) {
+						SettleMoved();
+					}
+
+					BeginTick();
+
+					_tick_open = true;
+				}
+
+				std::chrono::steady_clock::time_point 
+          row_start = std::chrono::steady_clock::now();
+				float 
+          elapsed = std::chrono::duration<float, std::milli>(row_start - start).count();
+
+				if (done > 0 && elapsed + _row_cost[_next_row] > budget) {
+					break;
+				}
+
+				UpdateCellularRow(_next_row);
+
+				float cost = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - row_start).count();
+
+				_row_cost[_next_row] = 0.9f*_row_cost[_next_row] + 0.1f*cost;
+
+				done++;
+
+				if (++_next_row == rows) {
+					EndTick();
+
+					_next_row = 0;
+					_tick_open = false;
+				}
+			}
+
+			// the lag is bounded, otherwise a machine that can't keep up would never stop catching up
+			_lag = std::min(MAXIMUM_LAG, std::max(0.0f, _lag + 1.0f - (float)done/rows));
+		}
+
+		// Setting the particles that moved in the last tick to not moved, which is otherwise done by
+		// the render of the damaged granules
+		void SettleMoved()
+		{
+			int 
+        granules = (_cells >> DAMAGE_SHIFT) + 1;
+
+			for (int granule=_damage->Next(0, granules); granule>=0; granule=_damage->Next(granule + 1, granules)) {
+				int end = std::min(_cells, (granule + 1) << DAMAGE_SHIFT);
+
+				for (int index=granule << DAMAGE_SHIFT; index<end; index++) {
+					jparticle_type_t type = _vs[index];
+
+					if (IsMoving(type) && type % 2 == 1) {
+						SetParticle(index, (jparticle_type_t)(type - 1));
+					}
+				}
+			}
+		}
+
+		// Finishing the rows left in a tick that the budget kept open, so the sweep can be switched off
+		// or to another engine with every tick begun also ended
+		void CloseTick()
+		{
+			if (_tick_open == false) {
+				return;
+			}
+
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			for (; _next_row<size.y-DASHBOARD_SIZE; _next_row++) {
+				UpdateCellularRow(_next_row);
+			}
+
+			EndTick();
+
+			_next_row = 0;
+			_tick_open = false;
+		}
+
+		// Updating the block rows [first_row, last_row) of a Margolus phase. The blocks only read and
+		// write their own 4 cells, so the bands run on any thread; the cells that changed are reported
+		// in 'band' to be accounted by ParticleChanged() after the phase
+		void UpdateMargolusBand(int phase, int first_row, int last_row, jmargolus_band_t *band)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			for (int y=first_row; y<last_row; y+=2) {
+				for (int x=phase; x+1<size.x; x+=2) {
+					// jump to the next block with something inside
+					int upper = NextInRow(_occupancy, x, size.x, y);
+					int lower = NextInRow(_occupancy, x, size.x, y + 1);
+
+					upper = (upper < 0)?size.x:upper;
+					lower = (lower < 0)?size.x:lower;
+					x = std::min(upper, lower);
+					x = x - ((x - phase) & 1);
+
+					if (x + 1 >= size.x) {
+						break;
+					}
+
+					int cells[4] = {
+						Index(x, y), Index(x + 1, y), Index(x, y + 1), Index(x + 1, y + 1)
+					};
+					jparticle_type_t t[4] = {
+						_vs[cells[0]], _vs[cells[1]], _vs[cells[2]], _vs[cells[3]]
+					};
+
+					// the tiles are shared by the bands of two threads
+					if (_cost_overlay == true) {
+						std::atomic_ref<uint32_t>(_cost_ticks[CostTile(x, y)]).fetch_add(4, std::memory_order_relaxed);
+					}
+
+					uint64_t dice = Random(x, y, RANDOM_MARGOLUS).Next();
+
+					for (int i=0; i<4; i++) {
+						if (((dice >> (16*i)) & 0xffff) < _margolus_decay[t[i]]) {
+#ifdef JSAND_REACTION_COUNTERS
+							band->decays[(t[i] >= JPT_WATER)?(t[i] & ~1):t[i]]++;
+#endif
+
+							t[i] = JPT_NOTHING;
+						}
+					}
+
+					int state = 
+						_margolus_class[t[0]]*125 + _margolus_class[t[1]]*25 + _margolus_class[t[2]]*5 + _margolus_class[t[3]];
+					uint8_t rule = _margolus_rules[Hash(dice) & 1][state];
+
+					for (int i=0; i<4; i++) {
+						jparticle_type_t next = t[(rule >> (2*i)) & 3];
+
+						if (next != _vs[cells[i]]) {
+							band->changes.push_back({cells[i], _vs[cells[i]]});
+
+							_vs[cells[i]] = next;
+						}
+					}
+				}
+			}
+		}
+
+		// The block rows [first_row, last_row) of the band of a phase
+		inline void MargolusBandRows(int band, int phase, int *first_row, int *last_row)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int 
+        rows = (size.y - DASHBOARD_SIZE - phase)/2,
+        bands = _margolus_bands.size();
+
+			*first_row = phase + 2*((rows*band)/bands);
+			*last_row = phase + 2*((rows*(band + 1))/bands);
+		}
+
+		// A worker of the Margolus engine, which updates its band at every phase started by
+		// UpdateMargolusScreen() until the screen goes away
+		void MargolusWorker(int band)
+		{
+			uint64_t generation = 0;
+
+			for (;;) {
+				int phase, first_row, last_row;
+
+				{
+					std::unique_lock<std::mutex> lock(_margolus_mutex);
+
+					_margolus_start.wait(lock, [&] { return _margolus_generation != generation || _margolus_stop == true; });
+
+					if (_margolus_stop == true) {
+						return;
+					}
+
+					generation = _margolus_generation;
+					phase = _margolus_phase;
+				}
+
+				MargolusBandRows(band, phase, &first_row, &last_row);
+				UpdateMargolusBand(phase, first_row, last_row, &_margolus_bands[band]);
+
+				{
+					std::lock_guard<std::mutex> lock(_margolus_mutex);
+
+					if (--_margolus_pending == 0) {
+						_margolus_done.notify_one();
+					}
+				}
+			}
+		}
+
+		// Updating the particle system with 2x2 blocks whose offset alternates at each tick. The
+		// result doesn't depend on the order of the blocks, so the block rows are split in bands and
+		// updated in parallel. The workers of the bands are started by the first tick and wait for
+		// the next phase between ticks; the calling thread updates the last band itself
+		inline void UpdateMargolusScreen()
+		{
+			if (_margolus_bands.empty() == true) {
+        jcanvas::jpoint_t<int>
+          size = GetSize();
+				int 
+          rows = (size.y - DASHBOARD_SIZE - 1)/2,
+          threads = std::max(1, std::min((int)std::thread::hardware_concurrency(), rows/16));
+
+				_margolus_bands.resize(threads);
+
+				for (int i=0; i<threads-1; i++) {
+					_margolus_workers.emplace_back(&Screen::MargolusWorker, this, i);
+				}
+			}
+
+			int 
+        phase = _tick & 1,
+        bands = _margolus_bands.size(),
+        first_row,
+        last_row;
+
+			{
+				std::lock_guard<std::mutex> lock(_margolus_mutex);
+
+				_margolus_phase = phase;
+				_margolus_pending = bands - 1;
+				_margolus_generation++;
+			}
+
+			_margolus_start.notify_all();
+
+			MargolusBandRows(bands - 1, phase, &first_row, &last_row);
+			UpdateMargolusBand(phase, first_row, last_row, &_margolus_bands[bands - 1]);
+
+			{
+				std::unique_lock<std::mutex> lock(_margolus_mutex);
+
+				_margolus_done.wait(lock, [this] { return _margolus_pending == 0; });
+			}
+
+			// the bands keep their storage for the next tick
+			for (auto &band : _margolus_bands) {
+				for (auto &change : band.changes) {
+					ParticleChanged(change.first, change.second, _vs[change.first]);
+				}
+
+				band.changes.clear();
+
+#ifdef JSAND_REACTION_COUNTERS
+				// the decays of the band are counted as reactions to nothing
+				for (int type=0; type<PARTICLETYPE_ENUM_LENGTH; type++) {
+					_reactions[type*PARTICLETYPE_ENUM_LENGTH + JPT_NOTHING] += band.decays[type];
+				}
+
+				band.decays.fill(0);
+#endif
+			}
+		}
+
+		// Levelling the connected liquid surfaces. A span is a run of cells of a row holding the same
+		// liquid or air, all of them resting on something; its holes are filled with the top cells of
+		// the tallest liquid columns standing on the span. Rows are walked bottom up, so a mound flows
+		// down a whole layer per pass instead of one cell per tick
+		void LevelLiquids()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			std::vector<int>
+        holes;
+			std::vector<std::pair<int, int>>
+        columns;
+
+			for (int y=size.y-DASHBOARD_SIZE-2; y>0; y--) {
+				if (NextInRow(_motion, 0, size.x, y) < 0) {
+					continue;
+				}
+
+				int x = 0;
+
+				while (x < size.x) {
+					jparticle_type_t liquid = JPT_NOTHING;
+					int start = x;
+
+					holes.clear();
+					columns.clear();
+
+					for (; x<size.x; x++) {
+						int index = Index(x, y);
+						jparticle_type_t t = _vs[index];
+
+						if (IsMoving(t)) {
+							t = (jparticle_type_t)(t & ~1);
+						}
+
+						if (_vs[Index(x, y + 1)] == JPT_NOTHING || (t != JPT_NOTHING && _dispersion[t + 1] <= 1)) {
+							break;
+						}
+
+						if (t == JPT_NOTHING) {
+							holes.push_back(index);
+						} else if (liquid == JPT_NOTHING || liquid == t) {
+							liquid = t;
+
+							int height = 1;
+
+							while ((_vs[Index(x, y - height)] & ~1) == liquid) {
+								height++;
+							}
+
+							if (height > 1) {
+								columns.push_back({height, x});
+							}
+						} else {
+							break;
+						}
+					}
+
+					if (x == start) {
+						x++;
+					}
+
+					if (holes.empty() == true || columns.empty() == true) {
+						continue;
+					}
+
+					std::make_heap(columns.begin(), columns.end());
+
+					for (int hole : holes) {
+						if (columns.empty() == true) {
+							break;
+						}
+
+						std::pop_heap(columns.begin(), columns.end());
+
+						std::pair<int, int> &column = columns.back();
+
+						SetParticle(Index(column.second, y - (column.first - 1)), JPT_NOTHING);
+						SetParticle(hole, (jparticle_type_t)(liquid + 1));
+
+						if (--column.first > 1) {
+							std::push_heap(columns.begin(), columns.end());
+						} else {
+							columns.pop_back();
+						}
+					}
+				}
+			}
+		}
+
+		// Setting every moved particle back to not moved, what the render does at each frame
+		void ResetMovedFlags()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+				for (int x=NextInRow(_motion, 0, size.x, y); x>=0; x=NextInRow(_motion, x + 1, size.x, y)) {
+					int index = Index(x, y);
+
+					if (_vs[index] % 2 == 1) {
+						SetParticle(index, (jparticle_type_t)(_vs[index] - 1));
+					}
+				}
+			}
+		}
+
+		// Running the simulation without showing the window, over walls and a screen half filled
+		// with particles, and reporting the time per tick
+		void Benchmark(int ticks)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			jparticle_type_t 
+        types[4] = {JPT_SAND, JPT_WATER, JPT_SALT, JPT_OIL};
+
+			srand(1);
+
+			_seed = 1;
+
+			DoRandomLines(JPT_WALL);
+
+			for (int y=0; y<(size.y - DASHBOARD_SIZE)/2; y++) {
+				for (int x=0; x<size.x; x++) {
+					if (_vs[Index(x, y)] == JPT_NOTHING && rand()%3 == 0) {
+						SetParticle(Index(x, y), types[rand()%4]);
+					}
+				}
+			}
+
+			std::chrono::steady_clock::time_point 
+        start = std::chrono::steady_clock::now();
+
+			for (int i=0; i<ticks; i++) {
+				UpdateVirtualScreen();
+				ResetMovedFlags();
+			}
+
+			float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+#ifdef JSAND_TILED_LAYOUT
+			const char *layout = "tiled";
+#else
+			const char *layout = "row-major";
+#endif
+
+			printf("%s layout, %s kernels, %dx%d cells, %s engine: %d ticks in %.1f ms (%.3f ms/tick)\n", 
+          layout, kernels->name, size.x, size.y - DASHBOARD_SIZE, (_engine == JSE_MARGOLUS)?"margolus":"cellular", ticks, ms, ms/std::max(1, ticks));
+		}
+
+		inline void DamageAll()
+		{
+			for (int i=0; i<=(_cells >> DAMAGE_SHIFT); i++) {
+				_damage->Set(i);
+			}
+		}
+
+		// Rendering the damaged granules of the virtual screen to the pixel buffer. Moved particles
+		// are always in a damaged granule, since moving there damaged it, so their flags are reset
+		// here as well
+		void RenderDamage(bool sparks)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int 
+        granules = (_cells >> DAMAGE_SHIFT) + 1;
+			bool
+        overview = (_overview_level > 0),
+        settle = (_tick_open == false);
+
+			_unsettled.clear();
+
+			for (int granule=_damage->Next(0, granules); granule>=0; granule=_damage->Next(granule + 1, granules)) {
+				int end = std::min(_cells, (granule + 1) << DAMAGE_SHIFT);
+
+				for (int index=granule << DAMAGE_SHIFT; index<end;) {
+					if (_vs[index] == JPT_BORDER) {
+						index++;
+
+						continue;
+					}
+
+					// the cells up to the end of the run of the row are contiguous in the pixel buffer too,
+					// so they are painted at once
+					jcanvas::jpoint_t<int> position = Position(index);
+					int length = std::min(end - index, std::min(size.x, RunEnd(position.x)) - position.x);
+					uint32_t *pixels = _pixels + position.x + (position.y*size.x);
+
+					kernels->paint_row(pixels, _vs + index, length, colors);
+
+					if (overview == true) {
+						for (int x=position.x >> MIP_LEVELS; x<=(position.x + length - 1) >> MIP_LEVELS; x++) {
+							_mip_dirty->Set((position.y >> MIP_LEVELS)*_mip_columns + x);
+						}
+					}
+
+					for (int i=0; i<length; i++) {
+						jparticle_type_t same = _vs[index + i];
+
+						if (sparks == true && IsEnergized(index + i) && (Hash(_tick ^ (index + i)) & 1) == 0) { // Flickering network
+							pixels[i] = colors[JPT_ELEC];
+						} else if (IsMoving(same) && same % 2 == 1) { // Moved
+							if (settle == true) {
+								SetParticle(index + i, (jparticle_type_t)(same - 1)); // Set it to not moved
+							} else if (_unsettled.empty() == true || _unsettled.back() != granule) {
+								_unsettled.push_back(granule);
+							}
+						}
+					}
+
+					index = index + length;
+				}
+			}
+
+			_damage->Clear();
+
+			// a tick left open by the budget still has rows to sweep, and the particles that moved in
+			// it must not move again before it ends, so their granules wait for the next frame
+			for (int granule : _unsettled) {
+				_damage->Set(granule);
+			}
+		}
+
+		// The material that covers most of a block of 2x2 cells. The empty cells only win when there is
+		// nothing else in the block
+		static inline uint8_t Dominant(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+		{
+			if (a != JPT_NOTHING && (a == b || a == c || a == d)) {
+				return a;
+			}
+
+			if (b != JPT_NOTHING && (b == c || b == d)) {
+				return b;
+			}
+
+			if (c != JPT_NOTHING && c == d) {
+				return c;
+			}
+
+			return (a != JPT_NOTHING)?a:(b != JPT_NOTHING)?b:(c != JPT_NOTHING)?c:d;
+		}
+
+		// The material of a cell as shown by the overview, at rest and with the cells out of the
+		// playfield of width x height (and the borders) left empty
+		inline uint8_t OverviewCell(int x, int y, int width, int height)
+		{
+			if (x >= width || y >= height) {
+				return JPT_NOTHING;
+			}
+
+			int type = _vs[Index(x, y)];
+
+			if (type == JPT_BORDER) {
+				return JPT_NOTHING;
+			}
+
+			if (IsMoving((jparticle_type_t)type) && type % 2 == 1) {
+				return type - 1;
+			}
+
+			return type;
+		}
+
+		inline uint8_t MipBlock(int k, int x, int y)
+		{
+			if (x >= _mip_width[k] || y >= _mip_height[k]) {
+				return JPT_NOTHING;
+			}
+
+			return _mip[k][x + y*_mip_width[k]];
+		}
+
+		// Rebuilding every level of the pyramid over one tile, from the cells up
+		void UpdateMipTile(int tile)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int 
+        rows = size.y - DASHBOARD_SIZE;
+			int tx = (tile % _mip_columns) << MIP_LEVELS;
+			int ty = (tile / _mip_columns) << MIP_LEVELS;
+
+			for (int k=0; k<MIP_LEVELS; k++) {
+				int side = 1 << (MIP_LEVELS - k - 1);
+				int bx = tx >> (k + 1);
+				int by = ty >> (k + 1);
+				int width = std::min(side, _mip_width[k] - bx);
+				int height = std::min(side, _mip_height[k] - by);
+
+				for (int y=by; y<by+height; y++) {
+					for (int x=bx; x<bx+width; x++) {
+						uint8_t value;
+
+						if (k == 0) {
+							value = Dominant(OverviewCell(2*x, 2*y, size.x, rows), OverviewCell(2*x + 1, 2*y, size.x, rows), OverviewCell(2*x, 2*y + 1, size.x, rows), OverviewCell(2*x + 1, 2*y + 1, size.x, rows));
+						} else {
+							value = Dominant(MipBlock(k - 1, 2*x, 2*y), MipBlock(k - 1, 2*x + 1, 2*y), MipBlock(k - 1, 2*x, 2*y + 1), MipBlock(k - 1, 2*x + 1, 2*y + 1));
+						}
+
+						_mip[k][x + y*_mip_width[k]] = value;
+					}
+				}
+			}
+		}
+
+		// Bringing the pyramid up to date with the tiles rendered since the last frame. Showing the
+		// overview again rebuilds all of it, since the tiles aren't tracked while it is hidden
+		void UpdateOverview(bool all)
+		{
+			int 
+        tiles = _mip_columns*_mip_rows;
+
+			if (all == true) {
+				for (int i=0; i<tiles; i++) {
+					_mip_dirty->Set(i);
+				}
+			}
+
+			for (int tile=_mip_dirty->Next(0, tiles); tile>=0; tile=_mip_dirty->Next(tile + 1, tiles)) {
+				UpdateMipTile(tile);
+			}
+
+			_mip_dirty->Clear();
+		}
+
+		// Drawing the level of the pyramid chosen by the zoom in the inset, from the panned position.
+		// The cost depends on the inset, not on the size of the screen
+		void drawOverview(jcanvas::Graphics *g)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int 
+        k = _overview_level - 1;
+			int 
+        ox = std::max(0, std::min(_overview_x >> _overview_level, _mip_width[k] - OVERVIEW_WIDTH));
+			int 
+        oy = std::max(0, std::min(_overview_y >> _overview_level, _mip_height[k] - OVERVIEW_HEIGHT));
+
+			for (int y=0; y<OVERVIEW_HEIGHT; y++) {
+				for (int x=0; x<OVERVIEW_WIDTH; x++) {
+					_overview_pixels[x + y*OVERVIEW_WIDTH] = colors[MipBlock(k, ox + x, oy + y)];
+				}
+			}
+
+			jcanvas::jrect_t<int> 
+        bounds = {BUTTON_GAP, size.y - DASHBOARD_SIZE - OVERVIEW_HEIGHT - BUTTON_GAP, OVERVIEW_WIDTH, OVERVIEW_HEIGHT};
+
+			g->SetRGBArray(_overview_pixels, bounds);
+
+			DrawRect(g, bounds, 0xffffffff);
+		}
+
+		// Drawing the dashboard to an image, which is only done again when what it shows changes
+		void DrawDashboard(jcanvas::Graphics *g)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int 
+        key = _current_particle | (_pen_size << 8) | (_emit_water << 16) | (_emit_sand << 17) | (_emit_salt << 18) | (_emit_oil << 19);
+
+			if (_dashboard == nullptr) {
+				_dashboard = new jcanvas::BufferedImage(jcanvas::jpixelformat_t::ARGB, {size.x, DASHBOARD_SIZE});
+			}
+
+			if (key != _dashboard_key) {
+				jcanvas::Graphics *ig = _dashboard->GetGraphics();
+
+				ig->Translate({0, -(size.y - DASHBOARD_SIZE)});
+
+				FillRect(ig, {0, size.y - DASHBOARD_SIZE, size.x, DASHBOARD_SIZE}, 0xff9b9b9b);
+
+				FillRect(ig, _buttons[0].rect, colors[JPT_WATER]);
+				FillRect(ig, _buttons[1].rect, colors[JPT_SAND]);
+				FillRect(ig, _buttons[2].rect, colors[JPT_SALT]);
+				FillRect(ig, _buttons[3].rect, colors[JPT_OIL]);
+				FillRect(ig, _buttons[4].rect, colors[JPT_FIRE]);
+				FillRect(ig, _buttons[5].rect, colors[JPT_ACID]);
+				FillRect(ig, _buttons[6].rect, colors[JPT_DIRT]);
+				FillRect(ig, _buttons[7].rect, colors[JPT_WATERSPOUT]);
+				FillRect(ig, _buttons[8].rect, colors[JPT_SANDSPOUT]);
+				FillRect(ig, _buttons[9].rect, colors[JPT_SALTSPOUT]);
+				FillRect(ig, _buttons[10].rect, colors[JPT_OILSPOUT]);
+				FillRect(ig, _buttons[11].rect, colors[JPT_WALL]);
+				FillRect(ig, _buttons[12].rect, colors[JPT_TORCH]);
+				FillRect(ig, _buttons[13].rect, colors[JPT_STOVE]);
+				FillRect(ig, _buttons[14].rect, colors[JPT_PLANT]);
+				FillRect(ig, _buttons[15].rect, colors[JPT_ICE]);
+				FillRect(ig, _buttons[16].rect, colors[JPT_IRONWALL]);
+				FillRect(ig, _buttons[17].rect, colors[JPT_VOID]);
+				FillRect(ig, _buttons[18].rect, 0);
+
+				drawSelection(ig);
+				drawPenSize(ig);
+
+				ig->Translate({0, size.y - DASHBOARD_SIZE});
+
+				_dashboard_key = key;
+			}
+
+			g->DrawImage(_dashboard, jcanvas::jpoint_t<int>{0, size.y - DASHBOARD_SIZE});
+		}
+
+		// Starting an edit of the user (a stroke, a clear, random lines). The cells it writes are
+		// saved in chunks allocated on their first write, so undoing it costs the touched area only
+		void BeginEdit()
+		{
+			EndEdit();
+
+			_editing = true;
+			_edit_serial++;
+		}
+
+		void EndEdit()
+		{
+			if (_editing == false) {
+				return;
+			}
+
+			_editing = false;
+
+			if (_edit.chunks.empty() == true) {
+				return;
+			}
+
+			for (auto &entry : _redo) {
+				_history_size -= HistorySize(entry);
+			}
+
+			_redo.clear();
+			_history_size += HistorySize(_edit);
+			_undo.push_back(std::move(_edit));
+			_edit = jhistory_entry_t();
+
+			while (_history_size > HISTORY_BUDGET && _undo.size() > 1) {
+				_history_size -= HistorySize(_undo.front());
+				_undo.pop_front();
+			}
+		}
+
+		inline size_t HistorySize(const jhistory_entry_t &entry)
+		{
+			return (entry.cells.size() + entry.edited.size())*sizeof(jparticle_type_t);
+		}
+
+		// Writing a cell on behalf of the user, which opens an edit if there is none yet
+		inline void EditParticle(int index, jparticle_type_t type)
+		{
+			if (_vs[index] == type) {
+				return;
+			}
+
+			if (_editing == false) {
+				BeginEdit();
+			}
+
+			SaveChunk(index >> HISTORY_CHUNK_SHIFT);
+			SaveCell(index, _vs[index], type);
+			SetParticle(index, type);
+		}
+
+		// Allocating a chunk in the edit the first time the edit touches it
+		inline void SaveChunk(int chunk)
+		{
+			if (_chunk_serial[chunk] != _edit_serial) {
+				_chunk_serial[chunk] = _edit_serial;
+				_chunk_slot[chunk] = _edit.chunks.size();
+				_edit.chunks.push_back(chunk);
+				_edit.cells.resize(_edit.chunks.size() << HISTORY_CHUNK_SHIFT, JPT_BORDER);
+				_edit.edited.resize(_edit.chunks.size() << HISTORY_CHUNK_SHIFT, JPT_BORDER);
+			}
+		}
+
+		// Saving a cell the edit writes, in a chunk already saved: the type it had before the first
+		// write of the edit, which isn't the type of the chunk when the edit began if the particles
+		// moved in the meantime, and the type of the last write
+		inline void SaveCell(int index, jparticle_type_t old, jparticle_type_t type)
+		{
+			size_t 
+        slot = ((size_t)_chunk_slot[index >> HISTORY_CHUNK_SHIFT] << HISTORY_CHUNK_SHIFT) + (index & ((1 << HISTORY_CHUNK_SHIFT) - 1));
+
+			if (_edit.edited[slot] == JPT_BORDER) {
+				_edit.cells[slot] = old;
+			}
+
+			_edit.edited[slot] = type;
+		}
+
+		// Saving the chunks of the run [begin, begin + length) in the edit of the undo history
+		inline void SaveRun(int begin, int length)
+		{
+			if (_editing == false) {
+				BeginEdit();
+			}
+
+			for (int chunk=begin >> HISTORY_CHUNK_SHIFT; chunk<=(begin + length - 1) >> HISTORY_CHUNK_SHIFT; chunk++) {
+				SaveChunk(chunk);
+			}
+		}
+
+		// Accounting the cells of a run that changed from the values saved in _run
+		inline void AccountRun(int begin, int length)
+		{
+			for (int i=0; i<length; i++) {
+				if (_run[i] != _vs[begin + i]) {
+					SaveCell(begin + i, _run[i], _vs[begin + i]);
+					ParticleChanged(begin + i, _run[i], _vs[begin + i]);
+				}
+			}
+		}
+
+		// Writing a run of contiguous cells on behalf of the user with a single copy
+		void WriteRun(int begin, int length, const jparticle_type_t *cells)
+		{
+			jparticle_type_t *run = _vs + begin;
+
+			if (std::equal(run, run + length, cells) == true) {
+				return;
+			}
+
+			SaveRun(begin, length);
+
+			_run.assign(run, run + length);
+
+			memcpy(run, cells, length*sizeof(jparticle_type_t));
+
+			AccountRun(begin, length);
+		}
+
+		// Filling a run of contiguous cells on behalf of the user
+		void FillRun(int begin, int length, jparticle_type_t type)
+		{
+			jparticle_type_t *run = _vs + begin;
+
+			if (std::all_of(run, run + length, [type](jparticle_type_t t) { return t == type; }) == true) {
+				return;
+			}
+
+			SaveRun(begin, length);
+
+			_run.assign(run, run + length);
+
+			std::fill(run, run + length, type);
+
+			AccountRun(begin, length);
+		}
+
+		// Calling fn(x, y, length) for the runs of contiguous cells that cover the part of the region
+		// inside the screen: a run per row of the region in the row-major layout, a run per tile and
+		// row in the tiled one
+		template <typename F>
+		void ForEachRun(jcanvas::jrect_t<int> region, F fn)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int 
+        x0 = std::max(0, region.point.x),
+        y0 = std::max(0, region.point.y),
+        x1 = std::min(size.x, region.point.x + region.size.x),
+        y1 = std::min(size.y - DASHBOARD_SIZE, region.point.y + region.size.y);
+
+			for (int y=y0; y<y1; y++) {
+				for (int x=x0; x<x1;) {
+					int end = std::min(x1, RunEnd(x));
+
+					fn(x, y, end - x);
+
+					x = end;
+				}
+			}
+		}
+
+		void FillRegion(jcanvas::jrect_t<int> region, jparticle_type_t type)
+		{
+			ForEachRun(region, [&](int x, int y, int length) {
+				FillRun(Index(x, y), length, type);
+			});
+		}
+
+		// Copying the part of the region inside the screen to a pattern, with the particles at rest
+		void CopyRegion(jcanvas::jrect_t<int> region, jprefab_t &pattern)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int 
+        x0 = std::max(0, region.point.x),
+        y0 = std::max(0, region.point.y);
+
+			pattern.width = std::max(0, std::min(size.x, region.point.x + region.size.x) - x0);
+			pattern.height = std::max(0, std::min(size.y - DASHBOARD_SIZE, region.point.y + region.size.y) - y0);
+			pattern.cells.resize(pattern.width*pattern.height);
+
+			ForEachRun(region, [&](int x, int y, int length) {
+				jparticle_type_t *cells = pattern.cells.data() + (x - x0) + (y - y0)*pattern.width;
+
+				memcpy(cells, _vs + Index(x, y), length*sizeof(jparticle_type_t));
+
+				for (int i=0; i<length; i++) {
+					if (IsMoving(cells[i])) {
+						cells[i] = (jparticle_type_t)(cells[i] & ~1);
+					}
+				}
+			});
+		}
+
+		// Pasting a pattern with its top left corner at point. The transparent cells (JPT_BORDER) keep
+		// what is below them, so every run is split in the spans of opaque cells
+		void PasteRegion(jcanvas::jpoint_t<int> point, const jprefab_t &pattern)
+		{
+			ForEachRun({point, {pattern.width, pattern.height}}, [&](int x, int y, int length) {
+				const jparticle_type_t *cells = pattern.cells.data() + (x - point.x) + (y - point.y)*pattern.width;
+				int begin = Index(x, y);
+
+				for (int i=0; i<length;) {
+					if (cells[i] == JPT_BORDER) {
+						i++;
+
+						continue;
+					}
+
+					int span = i;
+
+					while (span < length && cells[span] != JPT_BORDER) {
+						span++;
+					}
+
+					WriteRun(begin + i, span - i, cells + i);
+
+					i = span;
 				}
-			}
+			});
 		}
 
-		void StillbornParticleLogic(int x,int y,jparticle_type_t type)
+		// Stamping the prefab centered at (x, y)
+		void StampPrefab(int x, int y, const jprefab_t &prefab)
 		{
-      jcanvas::jpoint_t<int>
-        size = GetSize();
+			PasteRegion({x - prefab.width/2, y - prefab.height/2}, prefab);
+		}
+
+		// Loading a prefab from a binary PPM image. The colors of the particles map to their particle
+		// and magenta to a transparent cell, any other color to the particle of the nearest color. The
+		// sentinel and the unused types have no name and are never picked
+		bool LoadPrefab(std::string path)
+		{
+			FILE *file = fopen(path.c_str(), "rb");
+
+			if (file == nullptr) {
+				perror(path.c_str());
+
+				return false;
+			}
+
+			jprefab_t 
+        prefab;
 			int 
-        index, 
-        above, 
-        left, 
-        right, 
-        below, 
-        same, 
-        abovetwo;
+        maximum = 0;
+			bool 
+        success = fscanf(file, "P6 %d %d %d", &prefab.width, &prefab.height, &maximum) == 3 && fgetc(file) != EOF &&
+          prefab.width > 0 && prefab.height > 0 && prefab.width <= PREFAB_MAXIMUM_SIZE && prefab.height <= PREFAB_MAXIMUM_SIZE && maximum == 255;
+			std::vector<uint8_t> 
+        pixels;
 
-			switch (type) {
-				case JPT_VOID:
-					above = x + ((y - 1)*size.x);
-					left = (x + 1) + (y*size.x);
-					right = (x - 1) + (y*size.x);
-					below = x + ((y + 1)*size.x);
+			if (success == true) {
+				pixels.resize(3*prefab.width*prefab.height);
 
-					if (_vs[above] != JPT_NOTHING) {
-						_vs[above] = JPT_NOTHING;
-					}
+				success = fread(pixels.data(), 1, pixels.size(), file) == pixels.size();
+			}
 
-					if (_vs[below] != JPT_NOTHING) {
-						_vs[below] = JPT_NOTHING;
-					}
+			fclose(file);
 
-					if (_vs[left] != JPT_NOTHING) {
-						_vs[left] = JPT_NOTHING;
-					}
+			if (success == false) {
+				fprintf(stderr, "prefab: %s is not a binary PPM of up to %dx%d pixels\n", path.c_str(), PREFAB_MAXIMUM_SIZE, PREFAB_MAXIMUM_SIZE);
+
+				return false;
+			}
 
-					if (_vs[right] != JPT_NOTHING) {
-						_vs[right] = JPT_NOTHING;
+			prefab.name = path.substr(path.find_last_of('/') + 1);
+			prefab.cells.resize(prefab.width*prefab.height);
+
+			for (int i=0; i<prefab.width*prefab.height; i++) {
+				int r = pixels[3*i], g = pixels[3*i + 1], b = pixels[3*i + 2];
+				int nearest = INT32_MAX;
+
+				if (r == 0xff && g == 0x00 && b == 0xff) {
+					prefab.cells[i] = JPT_BORDER;
+
+					continue;
+				}
+
+				for (int t=0; t<PARTICLETYPE_ENUM_LENGTH; t++) {
+					if (GetParticleName((jparticle_type_t)t).empty() == true || (t >= JPT_WATER && t % 2 == 1)) {
+						continue;
 					}
 
-					break;
-				case JPT_IRONWALL:
-					above = x + ((y - 1)*size.x);
-					left = (x + 1) + (y*size.x);
-					right = (x - 1)+(y*size.x);
+					int dr = r - ((colors[t] >> 16) & 0xff), dg = g - ((colors[t] >> 8) & 0xff), db = b - (colors[t] & 0xff);
+					int distance = dr*dr + dg*dg + db*db;
 
-					if (rand()%200 == 0 && (_vs[above] == JPT_RUST || _vs[left] == JPT_RUST || _vs[right] == JPT_RUST)) {
-						_vs[x + (y*size.x)] = JPT_RUST;
+					if (distance < nearest) {
+						nearest = distance;
+						prefab.cells[i] = (jparticle_type_t)t;
 					}
+				}
+			}
 
-					break;
-				case JPT_TORCH:
-					above = x + ((y - 1)*size.x);
-					left = (x + 1) + (y*size.x);
-					right = (x - 1) + (y*size.x);
+			_prefabs.push_back(std::move(prefab));
 
-					if (rand()%2 == 0) { // Spawns fire
-						if (_vs[above] == JPT_NOTHING || _vs[above] == JPT_MOVEDFIRE) { //Fire above
-							_vs[above] = JPT_MOVEDFIRE;
-						}
+			return true;
+		}
 
-						if (_vs[right] == JPT_NOTHING || _vs[right] == JPT_MOVEDFIRE) { //Fire to the right
-							_vs[right] = JPT_MOVEDFIRE;
-						}
+		// Reverting the cells written by an edit, which turns an undo entry into its redo entry and
+		// vice versa. A cell is only written back while it still holds the type the edit left there,
+		// so the particles that moved since then aren't rewound or duplicated
+		void ExchangeEdit(jhistory_entry_t &entry)
+		{
+			for (size_t i=0; i<entry.chunks.size(); i++) {
+				int begin = entry.chunks[i] << HISTORY_CHUNK_SHIFT;
+				int end = std::min(_cells, begin + (1 << HISTORY_CHUNK_SHIFT));
+				jparticle_type_t *cells = entry.cells.data() + (i << HISTORY_CHUNK_SHIFT);
+				jparticle_type_t *edited = entry.edited.data() + (i << HISTORY_CHUNK_SHIFT);
 
-						if (_vs[left] == JPT_NOTHING || _vs[left] == JPT_MOVEDFIRE) { //Fire to the left
-							_vs[left] = JPT_MOVEDFIRE;
-						}
-					}
+				for (int index=begin; index<end; index++) {
+					jparticle_type_t type = cells[index - begin];
 
-					if (_vs[above] == JPT_MOVEDWATER || _vs[above] == JPT_WATER) { //Fire above
-						_vs[above] = JPT_MOVEDSTEAM;
+					if (edited[index - begin] == JPT_BORDER) {
+						continue;
 					}
 
-					if (_vs[right] == JPT_MOVEDWATER || _vs[right] == JPT_WATER) { //Fire to the right
-						_vs[right] = JPT_MOVEDSTEAM;
+					if (_vs[index] == edited[index - begin] && type != _vs[index]) {
+						SetParticle(index, type);
 					}
 
-					if (_vs[left] == JPT_MOVEDWATER || _vs[left] == JPT_WATER) { //Fire to the left
-						_vs[left] = JPT_MOVEDSTEAM;
-					}
+					cells[index - begin] = edited[index - begin];
+					edited[index - begin] = type;
+				}
+			}
+		}
 
-					break;
-				case JPT_PLANT:
-					if (rand()%2 == 0) { //Making the plant grow _slowly
-						index = 0;
+		void Undo()
+		{
+			EndEdit();
 
-						switch (rand()%4) {
-							case 0: index = (x - 1)+(y*size.x); break;
-							case 1: index = x + ((y - 1)*size.x); break;
-							case 2: index = (x + 1) + (y*size.x); break;
-							case 3:	index = x + ((y + 1)*size.x); break;
-						}
+			if (_undo.empty() == true) {
+				return;
+			}
 
-						if (_vs[index] == JPT_WATER) {
-							_vs[index] = JPT_PLANT;
-						}
-					}
-					break;
-				case JPT_EMBER:
-					below = x + ((y + 1)*size.x);
+			ExchangeEdit(_undo.back());
 
-					if (_vs[below] == JPT_NOTHING || IsBurnable(_vs[below])) {
-						_vs[below] = JPT_FIRE;
-					}
+			_redo.push_back(std::move(_undo.back()));
+			_undo.pop_back();
+		}
 
-					index = 0;
+		void Redo()
+		{
+			EndEdit();
 
-					switch (rand()%4) {
-						case 0: index = (x - 1) + (y*size.x); break;
-						case 1: index = x + ((y - 1)*size.x); break;
-						case 2: index = (x + 1) + (y*size.x); break;
-						case 3:	index = x + ((y + 1)*size.x); break;
-					}
+			if (_redo.empty() == true) {
+				return;
+			}
 
-					if (_vs[index] == JPT_PLANT) {
-						_vs[index] = JPT_FIRE;
-					}
+			ExchangeEdit(_redo.back());
 
-					if (rand()%18 == 0) { // Making ember burn out _slowly
-						_vs[x + (y*size.x)] = JPT_NOTHING;
-					}
+			_undo.push_back(std::move(_redo.back()));
+			_redo.pop_back();
+		}
 
-					break;
-				case JPT_STOVE:
-					above = x + ((y - 1)*size.x);
-					abovetwo = x + ((y - 2)*size.x);
+		// Exporting the grid in a POSIX shared memory segment (see jshared_grid_t), which is updated
+		// at every frame
+		bool ExportShared(std::string name)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			size_t 
+        length = sizeof(jshared_grid_t) + size.x*(size.y - DASHBOARD_SIZE)*sizeof(int32_t);
+			int 
+        fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
 
-					if (rand()%4 == 0 && _vs[above] == JPT_WATER) { // Boil the water
-						_vs[above] = JPT_STEAM;
-					}
+			if (fd < 0) {
+				perror("shm_open");
 
-					if (rand()%4 == 0 && _vs[above] == JPT_SALTWATER) { // Saltwater separates
-						_vs[above] = JPT_SALT;
-						_vs[abovetwo] = JPT_STEAM;
-					}
+				return false;
+			}
 
-					if (rand()%8 == 0 && _vs[above] == JPT_OIL) { // Set oil aflame
-						_vs[above] = JPT_EMBER;
-					}
+			if (ftruncate(fd, length) < 0) {
+				perror("ftruncate");
+				close(fd);
+				shm_unlink(name.c_str());
 
-					break;
-				case JPT_RUST:
-					if (rand()%7000 == 0) { //Deteriate rust
-						_vs[x + (y*size.x)] = JPT_NOTHING;
-					}
+				return false;
+			}
 
-					break;
+			void *address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-					//####################### SPOUTS ####################### 
-				case JPT_WATERSPOUT:
-					if (rand()%6 == 0) { // Take it easy on the spout
-						below = x + ((y + 1)*size.x);
+			close(fd);
 
-						if (_vs[below] == JPT_NOTHING) {
-							_vs[below] = JPT_MOVEDWATER;
-						}
-					}
+			if (address == MAP_FAILED) {
+				perror("mmap");
+				shm_unlink(name.c_str());
 
-					break;
-				case JPT_SANDSPOUT:
-					if (rand()%6 == 0) { // Take it easy on the spout
-						below = x + ((y + 1)*size.x);
+				return false;
+			}
 
-						if (_vs[below] == JPT_NOTHING) {
-							_vs[below] = JPT_MOVEDSAND;
-						}
-					}
+			_shared = new (address) jshared_grid_t();
+			_shared_size = length;
+			_shared_name = name;
 
-					break;
-				case JPT_SALTSPOUT:
-					if (rand()%6 == 0) { // Take it easy on the spout
-						below = x + ((y + 1)*size.x);
+			_shared->width = size.x;
+			_shared->height = size.y - DASHBOARD_SIZE;
+			_shared->version = SHARED_GRID_VERSION;
+			_shared->magic = SHARED_GRID_MAGIC;
 
-						if (_vs[below] == JPT_NOTHING) {
-							_vs[below] = JPT_MOVEDSALT;
-						}
+			return true;
+		}
 
-						if (_vs[below] == JPT_WATER || _vs[below] == JPT_MOVEDWATER) {
-							_vs[below] = JPT_MOVEDSALTWATER;
-						}
-					}
+		// Publishing the grid to the shared segment under its seqlock. The rows are copied run by
+		// run, since the virtual screen is padded (and possibly tiled)
+		void PublishShared()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			int32_t 
+        *cells = (int32_t *)(_shared + 1);
+			uint64_t 
+        sequence = _shared->sequence.load(std::memory_order_relaxed);
 
-					break;
-				case JPT_OILSPOUT:
-					if (rand()%6 == 0) { // Take it easy on the spout
-						below = x + ((y + 1)*size.x);
+			_shared->sequence.store(sequence + 1, std::memory_order_relaxed);
 
-						if (_vs[below] == JPT_NOTHING) {
-							_vs[below] = JPT_MOVEDOIL;
-						}
-					}
+			std::atomic_thread_fence(std::memory_order_release);
 
-					break;
-				default:
-					break;
+			for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+				for (int x=0; x<size.x; x=RunEnd(x)) {
+					int end = std::min(size.x, RunEnd(x));
+
+					memcpy(cells + x + (y*size.x), _vs + Index(x, y), (end - x)*sizeof(int32_t));
+				}
 			}
+
+			_shared->tick = _tick;
+			_shared->sequence.store(sequence + 2, std::memory_order_release);
 		}
 
-		// Performing the movement logic of a given particle. The argument 'type' is passed so that we don't need a table 
-		// lookup when determining the type to set the given particle to - i.e. if the particle is SAND then the passed type 
-		// will be MOVEDSAND
-		inline void MoveParticle(int x, int y, jparticle_type_t type)
+		// Recording the screen every 'interval' ticks (see FrameCapture)
+		bool StartCapture(std::string target, int interval)
 		{
       jcanvas::jpoint_t<int>
         size = GetSize();
 
-			type = (jparticle_type_t)(type+1);
+			_capture = new FrameCapture(target, size.x, size.y - DASHBOARD_SIZE, colors);
+			_capture_interval = std::max(1, interval);
+			_next_capture = _tick;
 
-			int above = x + ((y - 1)*size.x);
-			int same = x + (size.x*y);
-			int below = x + ((y + 1)*size.x);
+			if (_capture->IsOpen() == false) {
+				fprintf(stderr, "capture: unable to write to %s\n", target.c_str());
 
-			// If nothing below then just fall (gravity)
-			if (!IsFloating(type)) {
-				if ( (_vs[below] == JPT_NOTHING) && (rand() % 8)) { //rand() % 8 makes it spread
-					_vs[below] = type;
-					_vs[same] = JPT_NOTHING;
-					return;
-				}
-			} else {
-				if (rand()%3 == 0) { //Slow _is_button_down please
-					return;
-				}
+				delete _capture;
 
-				//If nothing above then rise (floating - or reverse gravity? ;))
-				if ((_vs[above] == JPT_NOTHING || _vs[above] == JPT_FIRE) && (rand() % 8) && (_vs[same] != JPT_ELEC) && (_vs[same] != JPT_MOVEDELEC)) { //rand() % 8 makes it spread
-					if (type == JPT_MOVEDFIRE && rand()%20 == 0) {
-						_vs[same] = JPT_NOTHING;
-					} else {
-						_vs[above] = _vs[same];
-						_vs[same] = JPT_NOTHING;
-					}
+				_capture = nullptr;
 
-					return;
-				}
+				return false;
 			}
 
-			//Randomly select right or left first
-			int sign = (rand() % 2 == 0)?-1:1;
+			return true;
+		}
 
-			// We'll only calculate these indicies once for optimization purpose
-			int first = (x + sign) + (size.x*y);
-			int second = (x - sign) + (size.x*y);
-			int index = 0;
+		// Copying the grid row by row, one byte per cell
+		void CopyCells(uint8_t *cells)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
 
-			//Particle type specific logic
-			switch (type) {
-				case JPT_MOVEDELEC:
-					if (rand()%2 == 0) {
-						_vs[same] = JPT_NOTHING;
-					}
+			for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+				for (int x=0; x<size.x; x++) {
+					cells[x + (y*size.x)] = (uint8_t)_vs[Index(x, y)];
+				}
+			}
+		}
 
-					break;
-				case JPT_MOVEDSTEAM:
-					if (rand()%1000 == 0) {
-						_vs[same] = JPT_MOVEDWATER;
+		bool IsControlled()
+		{
+			return _control != nullptr;
+		}
 
-						return;
-					}
+		bool StartControl(std::string path)
+		{
+			_control = new ControlServer(path);
 
-					if (rand()%500 == 0) {
-						_vs[same] = JPT_NOTHING;
+			if (_control->IsOpen() == false) {
+				fprintf(stderr, "control: unable to listen on %s\n", path.c_str());
 
-						return;
-					}
+				delete _control;
 
-					if (!IsStillborn(_vs[above]) && !IsFloating(_vs[above])) {
-						if (rand()%15 == 0) {
-							_vs[same] = JPT_NOTHING;
+				_control = nullptr;
 
-							return;
-						} else {
-							_vs[same] = _vs[above];
-							_vs[above] = JPT_MOVEDSTEAM;
+				return false;
+			}
 
-							return;
-						}
-					}
+			return true;
+		}
 
-					break;
-				case JPT_MOVEDFIRE:
-					if (!IsBurnable(_vs[above]) && rand()%10 == 0) {
-						_vs[same] = JPT_NOTHING;
+		// Running the commands of the control clients that arrived during the last tick. The strokes
+		// of a batch are a single edit of the undo history, unless they join a stroke of the user
+		void ServeControl()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			bool 
+        editing = _editing;
 
-						return;
-					}
+			_control->Take(_control_commands);
 
-					// Let the snowman melt!
-					if (rand()%4 == 0) {
-						if (_vs[above] == JPT_ICE) {
-							_vs[above] = JPT_WATER;
-							_vs[same] = JPT_NOTHING;
-						}
+			for (const jcontrol_command_t &command : _control_commands) {
+				const uint8_t *payload = command.payload.data();
+				size_t length = command.payload.size();
+				bool valid = true;
 
-						if (_vs[below] == JPT_ICE) {
-							_vs[below] = JPT_WATER;
-							_vs[same] = JPT_NOTHING;
-						}
+				if (command.opcode == CONTROL_CLOSED) {
+					_step_clients.erase(std::remove(_step_clients.begin(), _step_clients.end(), command.client), _step_clients.end());
+					_subscriptions.erase(std::remove_if(_subscriptions.begin(), _subscriptions.end(), [&](const jframe_subscription_t &s) {
+						return s.client == command.client;
+					}), _subscriptions.end());
 
-						if (_vs[first] == JPT_ICE) {
-							_vs[first] = JPT_WATER;
-							_vs[same] = JPT_NOTHING;
-						}
+					_control->Close(command.client);
+				} else if (command.opcode == JCO_STROKE || command.opcode == JCO_STAMP) {
+					jcontrol_stroke_t stroke;
 
-						if (_vs[second] == JPT_ICE) {
-							_vs[second] = JPT_WATER;
-							_vs[same] = JPT_NOTHING;
-						}
-					}
+					memcpy(&stroke, payload, std::min(length, sizeof(stroke)));
 
-					//Let's burn whatever we can!
-					index = 0;
+					valid = (length == sizeof(stroke) && stroke.type < PARTICLETYPE_ENUM_LENGTH && stroke.type != JPT_BORDER && stroke.radius <= 64);
 
-					switch (rand()%4) {
-						case 0: index = above; break;
-						case 1: index = below; break;
-						case 2: index = first; break;
-						case 3:	index = second; break;
+					if (command.opcode == JCO_STAMP) {
+						stroke.x1 = stroke.x0;
+						stroke.y1 = stroke.y0;
 					}
 
-					if (IsBurnable(_vs[index])) {
-						if (BurnsAsEmber(_vs[index])) {
-							_vs[index] = JPT_EMBER;
-						} else {
-							_vs[index] = JPT_FIRE;
+					if (valid == true) {
+						jparticle_type_t 
+              type = _current_particle;
+						int 
+              pen = _pen_size;
+
+						if (_editing == false) {
+							BeginEdit();
 						}
-					}
 
-					break;
-				case JPT_MOVEDWATER:
-					if (rand()%200 == 0 && _vs[below] == JPT_IRONWALL) {
-						_vs[below] = JPT_RUST;
-					}
+						_current_particle = (jparticle_type_t)stroke.type;
+						_pen_size = stroke.radius;
 
-					if (_vs[below]  == JPT_FIRE || _vs[above] == JPT_FIRE || _vs[first] == JPT_FIRE || _vs[second] == JPT_FIRE) {
-						_vs[same] = JPT_MOVEDSTEAM;
-					}
+						DrawLine(stroke.x1, stroke.y1, stroke.x0, stroke.y0);
 
-					//Making water+dirt into dirt
-					if (_vs[below] == JPT_DIRT) {
-						_vs[below] = JPT_MOVEDMUD;
-						_vs[same] = JPT_NOTHING;
+						_current_particle = type;
+						_pen_size = pen;
 					}
+				} else if (command.opcode == JCO_MATERIAL) {
+					valid = (length == 1 && payload[0] < PARTICLETYPE_ENUM_LENGTH && payload[0] != JPT_BORDER);
 
-					if (_vs[above] == JPT_DIRT) {
-						_vs[above] = JPT_MOVEDMUD;
-						_vs[same] = JPT_NOTHING;
+					if (valid == true) {
+						_current_particle = (jparticle_type_t)payload[0];
 					}
+				} else if (command.opcode == JCO_EMITTER) {
+					jcontrol_emitter_t emitter;
 
-					//Making water+salt into saltwater
-					if (_vs[above] == JPT_SALT || _vs[above] == JPT_MOVEDSALT) {
-						_vs[above] = JPT_MOVEDSALTWATER;
-						_vs[same] = JPT_NOTHING;
-					}
+					memcpy(&emitter, payload, std::min(length, sizeof(emitter)));
 
-					if (_vs[below] == JPT_SALT || _vs[below] == JPT_MOVEDSALT) {
-						_vs[below] = JPT_MOVEDSALTWATER;
-						_vs[same] = JPT_NOTHING;
-					}
+					valid = (length == sizeof(emitter) && emitter.emitter < 4 && emitter.density <= 100);
 
-					if (rand()%60 == 0) { //Melting ice
-						switch (rand()%4) {
-							case 0:	index = above; break;
-							case 1:	index = below; break;
-							case 2:	index = first; break;
-							case 3:	index = second; break;
-						}
+					if (valid == true) {
+						bool *emits[4] = {&_emit_water, &_emit_sand, &_emit_salt, &_emit_oil};
+						float *densities[4] = {&_water_density, &_sand_density, &_salt_density, &_oil_density};
 
-						if (_vs[index] == JPT_ICE) {
-							_vs[index] = JPT_WATER;
+						*emits[emitter.emitter] = (emitter.enabled != 0);
+
+						if (emitter.density > 0) {
+							*densities[emitter.emitter] = emitter.density/100.0f;
 						}
 					}
+				} else if (command.opcode == JCO_STEP) {
+					uint32_t ticks = 0;
 
-					break;
-				case JPT_MOVEDACID:
-					switch (rand()%4) {
-						case 0:	index = above; break;
-						case 1:	index = below; break;
-						case 2:	index = first; break;
-						case 3:	index = second; break;
-					}
+					memcpy(&ticks, payload, std::min(length, sizeof(ticks)));
 
-					if (_vs[index] != JPT_WALL && _vs[index] != JPT_IRONWALL && _vs[index] != JPT_WATER && _vs[index] != JPT_MOVEDWATER && _vs[index] != JPT_ACID && _vs[index] != JPT_MOVEDACID) {
-						_vs[index] = JPT_NOTHING;
-					}
+					valid = (length == sizeof(ticks));
 
-					break;
-				case JPT_MOVEDSALT:
-					if (rand()%20 == 0) {
-						switch (rand()%4) {
-							case 0:	index = above; break;
-							case 1:	index = below; break;
-							case 2:	index = first; break;
-							case 3:	index = second; break;
-						}
+					if (valid == true) {
+						_paused = true;
+						_steps = _steps + ticks;
 
-						if (_vs[index] == JPT_ICE) {
-							_vs[index] = JPT_WATER;
+						if (_steps == 0) {
+							_control->Reply(command.client, JCO_STEP, &_tick, sizeof(_tick));
+						} else {
+							_step_clients.push_back(command.client);
 						}
 					}
+				} else if (command.opcode == JCO_PAUSE) {
+					valid = (length == 1);
 
-					break;
-				case JPT_MOVEDSALTWATER:
-					//Saltwater separated by heat
-					//	if (_vs[above] == FIRE || _vs[below] == FIRE || _vs[first] == FIRE || _vs[second] == FIRE || _vs[above] == STOVE || _vs[below] == STOVE || _vs[first] == STOVE || _vs[second] == STOVE)
-					//	{
-					//		_vs[same] = SALT;
-					//		_vs[above] = STEAM;
-					//	}
-					if (rand()%40 == 0) { //Saltwater dissolves ice more _slowly than pure salt
-						switch (rand()%4) {
-							case 0:	index = above; break;
-							case 1:	index = below; break;
-							case 2:	index = first; break;
-							case 3:	index = second; break;
-						}
+					if (valid == true) {
+						_paused = (payload[0] != 0);
+					}
+				} else if (command.opcode == JCO_STATS) {
+					jcontrol_stats_t stats;
 
-						if (_vs[index] == JPT_ICE) {
-							_vs[index] = JPT_WATER;
+					memset(&stats, 0, sizeof(stats));
+
+					for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+						for (int x=0; x<size.x; x++) {
+							jparticle_type_t t = _vs[Index(x, y)];
+
+							stats.counts[IsMoving(t)?(t & ~1):t]++;
 						}
 					}
 
-					break;
-				case JPT_MOVEDOIL:
-					switch (rand()%4) {
-						case 0:	index = above; break;
-						case 1:	index = below; break;
-						case 2:	index = first; break;
-						case 3:	index = second; break;
-					}
+					stats.tick = _tick;
+					stats.particles = _particle_count;
 
-					if (_vs[index] == JPT_FIRE) {
-						_vs[same] = JPT_FIRE;
-					}
+					_control->Reply(command.client, JCO_STATS, &stats, sizeof(stats));
+				} else if (command.opcode == JCO_FILL || command.opcode == JCO_COPY || command.opcode == JCO_PASTE || command.opcode == JCO_PREFAB) {
+					jcontrol_region_t region;
 
-					break;
-				default:
-					break;
-			}
+					memcpy(&region, payload, std::min(length, sizeof(region)));
 
-			//Peform 'realism' logic?
-			// When adding dynamics to this part please use the following structure:
-			// If a particle A is ligther than particle B then add _vs[above] == B to the condition in case A (case MOVED_A)
-			if (_implement_particle_swaps) {
-				switch (type) {
-					case JPT_MOVEDWATER:
-						if (_vs[above] == JPT_SAND || _vs[above] == JPT_MUD || _vs[above] == JPT_SALTWATER && rand()%3 == 0) {
-							_vs[same] = _vs[above];
-							_vs[above] = type;
-
-							return;
-						}
+					valid = (length == sizeof(region));
 
-						break;
-					case JPT_MOVEDOIL:
-						if (_vs[above] == JPT_WATER && rand()%3 == 0) {
-							_vs[same] = _vs[above];
-							_vs[above] = type;
+					if (command.opcode == JCO_FILL) {
+						valid = valid && region.value < PARTICLETYPE_ENUM_LENGTH && region.value != JPT_BORDER;
+					} else if (command.opcode == JCO_PREFAB) {
+						valid = valid && region.value < _prefabs.size();
+					}
 
-							return;
+					if (valid == true) {
+						if (_editing == false && command.opcode != JCO_COPY) {
+							BeginEdit();
 						}
 
-						break;
-					case JPT_MOVEDSALTWATER:
-						if (_vs[above] == JPT_DIRT || _vs[above] == JPT_MUD || _vs[above] == JPT_SAND && rand()%3 == 0) {
-							_vs[same] = _vs[above];
-							_vs[above] = type;
-
-							return;
+						if (command.opcode == JCO_FILL) {
+							FillRegion({region.x, region.y, region.width, region.height}, (jparticle_type_t)region.value);
+						} else if (command.opcode == JCO_COPY) {
+							CopyRegion({region.x, region.y, region.width, region.height}, _clipboard);
+						} else if (command.opcode == JCO_PASTE) {
+							PasteRegion({region.x, region.y}, _clipboard);
+						} else {
+							StampPrefab(region.x, region.y, _prefabs[region.value]);
 						}
+					}
+				} else if (command.opcode == JCO_FRAMES) {
+					jcontrol_frames_t frames;
 
-						break;
-					default:
-						break;
-				}
-			}
+					memcpy(&frames, payload, std::min(length, sizeof(frames)));
 
-			// The place below (x,y+1) is filled with something, then check (x+sign,y+1) and (x-sign,y+1).
-			// We chose sign randomly to randomly check eigther left or right. This is for elements that fall _is_button_downward
-			if (!IsFloating(type)) {
-				int first_is_button_down = (x + sign) + ((y + 1)*size.x);
-				int second_is_button_down = (x - sign) + ((y + 1)*size.x);
+					valid = (length == sizeof(frames) && frames.scale > 0);
 
-				if ( _vs[first_is_button_down] == JPT_NOTHING) {
-					_vs[first_is_button_down] = type;
-					_vs[same] = JPT_NOTHING;
-				} else if ( _vs[second_is_button_down] == JPT_NOTHING) {
-					_vs[second_is_button_down] = type;
-					_vs[same] = JPT_NOTHING;
-				} else if (_vs[first] == JPT_NOTHING) {
-					_vs[first] = type;
-					_vs[same] = JPT_NOTHING;
-				} else if (_vs[second] == JPT_NOTHING) {
-					_vs[second] = type;
-					_vs[same] = JPT_NOTHING;
+					if (valid == true) {
+						_subscriptions.erase(std::remove_if(_subscriptions.begin(), _subscriptions.end(), [&](const jframe_subscription_t &s) {
+							return s.client == command.client;
+						}), _subscriptions.end());
+
+						if (frames.interval > 0) {
+							_subscriptions.push_back({command.client, frames.scale, frames.interval, _tick});
+						}
+					}
+				} else {
+					valid = false;
 				}
-			} else if (type == JPT_MOVEDSTEAM) {
-				// Make steam move
-				int firstup = (x + sign) + ((y - 1)*size.x);
-				int secondup = (x - sign) + ((y - 1)*size.x);
 
-				if ( _vs[firstup] == JPT_NOTHING) {
-					_vs[firstup] = type;
-					_vs[same] = JPT_NOTHING;
-				} else if ( _vs[secondup] == JPT_NOTHING) {
-					_vs[secondup] = type;
-					_vs[same] = JPT_NOTHING;
-				} else if (_vs[first] == JPT_NOTHING) {
-					_vs[first] = type;
-					_vs[same] = JPT_NOTHING;
-				} else if (_vs[second] == JPT_NOTHING) {
-					_vs[second] = type;
-					_vs[same] = JPT_NOTHING;
+				if (valid == false) {
+					_control->Reply(command.client, JCO_ERROR, &command.opcode, 1);
 				}
 			}
+
+			if (editing == false) {
+				EndEdit();
+			}
+
+			_control_commands.clear();
 		}
 
-		//Drawing a filled circle at a given position with a given radius and a given partice type
-		void DrawParticles(int xpos, int ypos, int radius, jparticle_type_t type)
+		// Streaming the frames due to the clients, sampling a cell of each block of scale x scale cells
+		void StreamFrames()
 		{
       jcanvas::jpoint_t<int>
         size = GetSize();
 
-			for (int x=((xpos-radius-1) < 0)?0:(xpos-radius-1); x<=xpos+radius && x<size.x; x++) {
-				for (int y=((ypos-radius-1) < 0)?0:(ypos-radius-1); y<=ypos+radius && y<size.y; y++) {
-					if ((x - xpos)*(x - xpos) + (y - ypos)*(y - ypos) <= radius*radius) {
-						_vs[x + (size.x*y)] = type;
+			for (jframe_subscription_t &subscription : _subscriptions) {
+				if (_tick < subscription.next) {
+					continue;
+				}
+
+				int scale = subscription.scale;
+				jcontrol_frame_t frame = {_tick, (uint16_t)((size.x + scale - 1)/scale), (uint16_t)((size.y - DASHBOARD_SIZE + scale - 1)/scale), 0};
+
+				_frame_cells.resize(frame.width*frame.height);
+
+				for (int y=0; y<frame.height; y++) {
+					for (int x=0; x<frame.width; x++) {
+						jparticle_type_t t = _vs[Index(x*scale, y*scale)];
+
+						_frame_cells[x + y*frame.width] = IsMoving(t)?(t & ~1):t;
 					}
 				}
+
+				subscription.next = _tick + subscription.interval;
+
+				_control->Reply(subscription.client, JCO_FRAMES, &frame, sizeof(frame), _frame_cells.data(), _frame_cells.size());
 			}
 		}
 
-		void DrawLine(int newx, int newy, int _old_x, int _old_y)
+		// Seeding the random decisions of the simulation, the same seed gives the same world
+		void SetSeed(uint64_t seed)
 		{
-			if (newx == _old_x && newy == _old_y) {
-				DrawParticles(newx,newy,_pen_size,_current_particle);
-			} else {
-				float step = 1.0f / ((abs(newx-_old_x)>abs(newy-_old_y)) ? abs(newx-_old_x) : abs(newy-_old_y));
+			_seed = seed;
+		}
 
-				for (float a = 0; a < 1; a+=step) {
-					DrawParticles(a*newx+(1-a)*_old_x,a*newy+(1-a)*_old_y,_pen_size,_current_particle); 
-				}
+		bool StartCheckpoints(std::string directory, int interval)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			_checkpoint = new Checkpointer(directory, size.x, size.y - DASHBOARD_SIZE);
+			_checkpoint_interval = std::max(1, interval);
+			_next_checkpoint = _tick + _checkpoint_interval;
+
+			if (_checkpoint->IsOpen() == false) {
+				fprintf(stderr, "checkpoint: unable to write to %s\n", directory.c_str());
+
+				delete _checkpoint;
+
+				_checkpoint = nullptr;
+
+				return false;
 			}
+
+			return true;
 		}
 
-		void DoRandomLines(jparticle_type_t type)
+		// Copying the grid to a checkpoint at a tick boundary. The pause of the simulation is this
+		// copy, the checkpoint is written by the worker of the checkpointer
+		void SaveCheckpoint()
 		{
-      jcanvas::jpoint_t<int>
-        size = GetSize();
-			jparticle_type_t 
-        tmp = _current_particle;
+			jcapture_frame_t 
+        snapshot;
 
-			_current_particle = type;
-
-			for (int i = 0; i < 20; i++) {
-				int x1 = rand() % size.x;
-				int x2 = rand() % size.x;
+			_next_checkpoint = _tick + _checkpoint_interval;
 
-				DrawLine(x1, 0, x2, size.y);
-			}
+			_checkpoint->Acquire(snapshot);
 
-			for (int i = 0; i < 20; i++) {
-				int y1 = rand() % size.y;
-				int y2 = rand() % size.y;
+			CopyCells(snapshot.cells.data());
 
-				DrawLine(0, y1, size.x, y2);
-			}
+			snapshot.tick = _tick;
 
-			_current_particle = tmp;
+			_checkpoint->Submit(std::move(snapshot));
 		}
 
-		inline void UpdateVirtualPixel(int x, int y)
+		// Loading the grid of a checkpoint saved by a screen of the same size. The particles in the
+		// middle of a move are put at rest, and the simulation goes on from the tick of the checkpoint
+		bool Resume(std::string path)
 		{
       jcanvas::jpoint_t<int>
         size = GetSize();
-			jparticle_type_t 
-        same = _vs[x + (size.x*y)];
+			jcapture_frame_t 
+        snapshot;
 
-			if (same != JPT_NOTHING) {
-				if (IsStillborn(same)) {
-					StillbornParticleLogic(x,y,same);
-				} else {
-					if (rand() >= RAND_MAX / 13 && same % 2 == 0) {
-						MoveParticle(x,y,same); //THe rand condition makes the particles fall unevenly
+			if (Checkpointer::Load(path, size.x, size.y - DASHBOARD_SIZE, snapshot) == false) {
+				fprintf(stderr, "resume: %s is not a checkpoint of a %dx%d screen\n", path.c_str(), size.x, size.y - DASHBOARD_SIZE);
+
+				return false;
+			}
+
+			for (int y=0; y<size.y-DASHBOARD_SIZE; y++) {
+				for (int x=0; x<size.x; x++) {
+					jparticle_type_t t = (jparticle_type_t)snapshot.cells[x + (y*size.x)];
+
+					if (IsMoving(t)) {
+						t = (jparticle_type_t)(t & ~1);
 					}
+
+					SetParticle(Index(x, y), t);
 				}
 			}
+
+			_tick = snapshot.tick;
+			_next_capture = _tick;
+			_next_checkpoint = _tick + _checkpoint_interval;
+
+			ScheduleDecays();
+
+			DamageAll();
+
+			return true;
 		}
 
-		// Updating the particle system (virtual screen) pixel by pixel
-		inline void UpdateVirtualScreen()
+		// Copying the grid to a frame of the capture. This is all the simulation thread does, the
+		// frame is dropped if there is none available
+		void CaptureFrame()
 		{
-      jcanvas::jpoint_t<int>
-        size = GetSize();
+			jcapture_frame_t 
+        frame;
 
-			for (int y =0; y<size.y-DASHBOARD_SIZE; y++) {
-				// Due to biasing when iterating through the scanline from left to right,
-				// we now chose our direction randomly per scanline.
-				if (rand() % 2 == 0) {
-					for (int x=size.x-2; x--;) {
-						UpdateVirtualPixel(x,y);
-					}
-				} else {
-					for (int x=1; x<size.x-1; x++) {
-						UpdateVirtualPixel(x,y);
-					}
-				}
+			_next_capture = _tick + _capture_interval;
+
+			if (_capture->Acquire(frame) == false) {
+				return;
 			}
+
+			CopyCells(frame.cells.data());
+
+			frame.tick = _tick;
+
+			_capture->Submit(std::move(frame));
 		}
 
 		//Cearing the particle system
@@ -854,11 +5359,50 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
       jcanvas::jpoint_t<int>
         size = GetSize();
 
-			for (int w=0; w<size.x ; w++) {
-				for (int h=0; h<size.y; h++) {
-					_vs[w + (size.x*h)] = JPT_NOTHING;
+			// the screen is saved in the undo history and cleared with a fill per run, then the
+			// bookkeeping of the particles is reset at once instead of cell by cell
+			ForEachRun({0, 0, size.x, size.y - DASHBOARD_SIZE}, [&](int x, int y, int length) {
+				jparticle_type_t *run = _vs + Index(x, y);
+
+				if (std::all_of(run, run + length, [](jparticle_type_t t) { return t == JPT_NOTHING; }) == false) {
+					SaveRun(Index(x, y), length);
+
+					for (int i=0; i<length; i++) {
+						if (run[i] != JPT_NOTHING) {
+							SaveCell(Index(x, y) + i, run[i], JPT_NOTHING);
+						}
+					}
+
+					std::fill(run, run + length, JPT_NOTHING);
 				}
-			}
+			});
+
+			_active.clear();
+			_fast.clear();
+
+			memset(_active_mark, 0, _cells);
+
+			_occupancy->Clear();
+			_motion->Clear();
+			_sleep->Clear();
+
+			_sleepers = 0;
+			_particle_count = 0;
+
+			std::fill(_layer_users, _layer_users + LAYER_COUNT, 0);
+
+			_timers.Reset(_tick);
+			_decay_due.clear();
+
+			DamageAll();
+
+			std::fill(_conductor, _conductor + _cells, -1);
+			std::fill(_energized, _energized + _cells, 0);
+
+			_unlinked->Clear();
+			_conduction_dirty = false;
+
+			std::fill(_heat, _heat + _heat_stride*(size.y + 2), HEAT_AMBIENT);
 		}
 
 		void DrawRect(jcanvas::Graphics *g, jcanvas::jrect_t<int> bounds, uint32_t color)
@@ -1130,6 +5674,14 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
         size = GetSize();
 
 			initColors();
+			initReactivity();
+			initMargolusRules();
+			initHeat();
+			initDispersion();
+			initKernels();
+			initConduction();
+			initLayers();
+			initDecay();
 
 			_scene = {
         .point = {
@@ -1170,85 +5722,6 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 			}
 		}
 
-		std::string GetParticleName(jparticle_type_t t)
-		{
-			if (t == JPT_NOTHING) {
-				return "EMPTY";
-			} else if (t == JPT_WALL) {
-				return "WALL";
-			} else if (t == JPT_IRONWALL) {
-				return "IRON WALL";
-			} else if (t == JPT_TORCH) {
-				return "TORCH";
-			} else if (t == JPT_STOVE) {
-				return "STOVE";
-			} else if (t == JPT_ICE) {
-				return "ICE";
-			} else if (t == JPT_RUST) {
-				return "RUST";
-			} else if (t == JPT_EMBER) {
-				return "EMBER";
-			} else if (t == JPT_PLANT) {
-				return "PLANT";
-			} else if (t == JPT_VOID) {
-				return "VOID";
-			} else if (t == JPT_WATERSPOUT) {
-				return "WATER SPOUT";
-			} else if (t == JPT_SANDSPOUT) {
-				return "SAND SPOUT";
-			} else if (t == JPT_SALTSPOUT) {
-				return "SALT SPOUT";
-			} else if (t == JPT_OILSPOUT) {
-				return "OIL SPOUT";
-			} else if (t == JPT_WATER) {
-				return "WATER";
-			} else if (t == JPT_MOVEDWATER) {
-				return "MOVED WATER";
-			} else if (t == JPT_DIRT) {
-				return "DIRT";
-			} else if (t == JPT_MOVEDDIRT) {
-				return "MOVED DIRT";
-			} else if (t == JPT_SALT) {
-				return "SALT";
-			} else if (t == JPT_MOVEDSALT) {
-				return "MOVED SALT";
-			} else if (t == JPT_OIL) {
-				return "OIL";
-			} else if (t == JPT_MOVEDOIL) {
-				return "MOVED OIL";
-			} else if (t == JPT_SAND) {
-				return "SAND";
-			} else if (t == JPT_MOVEDSAND) {
-				return "MOVED SAND";
-			} else if (t == JPT_SALTWATER) {
-				return "SALT WATER";
-			} else if (t == JPT_MOVEDSALTWATER) {
-				return "MOVED SALT WATER";
-			} else if (t == JPT_MUD) {
-				return "MUD";
-			} else if (t == JPT_MOVEDMUD) {
-				return "MOVED MUD";
-			} else if (t == JPT_ACID) {
-				return "ACID";
-			} else if (t == JPT_MOVEDACID) {
-				return "MOVED ACID";
-			} else if (t == JPT_STEAM) {
-				return "STEAM";
-			} else if (t == JPT_MOVEDSTEAM) {
-				return "MOVED STEAM";
-			} else if (t == JPT_FIRE) {
-				return "FIRE";
-			} else if (t == JPT_MOVEDFIRE) {
-				return "MOVED FIRE";
-			} else if (t == JPT_ELEC) {
-				return "ELECTRICITY";
-			} else if (t == JPT_MOVEDELEC) {
-				return "MOVED ELECTRICITY";
-			}
-
-			return "";
-		}
-
 		void drawSelection(jcanvas::Graphics *g)
 		{
       jcanvas::jpoint_t<int>
@@ -1312,12 +5785,129 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 			FillRect(g, rect, 0xff000000);
 		}
 
+		// Painting the cost of the tiles over the scene, from a faint yellow in the calm tiles to an
+		// opaque red in the hottest one, and listing the hottest tiles above the dashboard
+		void drawCostOverlay(jcanvas::Graphics *g)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			std::vector<int>
+        hottest;
+			float
+        maximum = 0.0f;
+
+			for (int i=0; i<_cost_columns*_cost_rows; i++) {
+				maximum = std::max(maximum, _cost[i]);
+
+				if (_cost[i] >= 0.5f) {
+					hottest.push_back(i);
+				}
+			}
+
+			if (hottest.empty() == true) {
+				return;
+			}
+
+			for (int i : hottest) {
+				float heat = _cost[i]/maximum;
+				uint32_t alpha = 0x20 + (uint32_t)(0x90*heat);
+				uint32_t green = (uint32_t)(0xff*(1.0f - heat));
+
+				FillRect(g, {(i % _cost_columns)*COST_TILE, (i / _cost_columns)*COST_TILE, COST_TILE, COST_TILE}, (alpha << 24) | 0xff0000 | (green << 8));
+			}
+
+			int count = std::min((int)hottest.size(), COST_TOP);
+
+			std::partial_sort(hottest.begin(), hottest.begin() + count, hottest.end(), [&](int a, int b) {
+				return _cost[a] > _cost[b];
+			});
+
+			char 
+        tmp[64];
+
+			g->SetColor(0xffffffff);
+
+			for (int i=0; i<count; i++) {
+				int tile = hottest[i];
+
+				snprintf(tmp, sizeof(tmp), "%d, %d: %.0f cells", (tile % _cost_columns)*COST_TILE, (tile / _cost_columns)*COST_TILE, _cost[tile]);
+
+				g->DrawString(tmp, {size.x/2, size.y - DASHBOARD_SIZE - (count - i)*BUTTON_SIZE, size.x/2 - BUTTON_GAP, BUTTON_SIZE}, jcanvas::jhorizontal_align_t::Right);
+			}
+		}
+
+#ifdef JSAND_REACTION_COUNTERS
+		// Listing the most frequent reactions at the top right of the screen, with the rate per tick
+		// and the count since the start
+		void drawReactions(jcanvas::Graphics *g)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			std::vector<int>
+        frequent;
+
+			for (int i=0; i<PARTICLETYPE_ENUM_LENGTH*PARTICLETYPE_ENUM_LENGTH; i++) {
+				if (_reaction_totals[i] > 0) {
+					frequent.push_back(i);
+				}
+			}
+
+			int count = std::min((int)frequent.size(), REACTION_TOP);
+
+			std::partial_sort(frequent.begin(), frequent.begin() + count, frequent.end(), [&](int a, int b) {
+				return _reaction_rate[a] > _reaction_rate[b];
+			});
+
+			char 
+        tmp[64];
+
+			g->SetColor(0xffffffff);
+
+			for (int i=0; i<count; i++) {
+				int pair = frequent[i];
+
+				snprintf(tmp, sizeof(tmp), "%s>%s %.1f/tick %llu", 
+            GetParticleName((jparticle_type_t)(pair / PARTICLETYPE_ENUM_LENGTH)).c_str(), GetParticleName((jparticle_type_t)(pair % PARTICLETYPE_ENUM_LENGTH)).c_str(), _reaction_rate[pair], (unsigned long long)_reaction_totals[pair]);
+
+				g->DrawString(tmp, {size.x/2, BUTTON_GAP + i*BUTTON_SIZE, size.x/2 - BUTTON_GAP, BUTTON_SIZE}, jcanvas::jhorizontal_align_t::Right);
+			}
+		}
+#endif
+
+		void drawStatistics(jcanvas::Graphics *g)
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+			char 
+        tmp[64];
+
+			if (_budget_mode == true && _engine == JSE_CELLULAR) {
+				snprintf(tmp, sizeof(tmp), "BUDGET %.2f/%.0f ms LAG %.1f ticks", _update_time, _frame_time, _lag);
+			} else {
+				snprintf(tmp, sizeof(tmp), "%s %.2f ms", (_engine == JSE_MARGOLUS)?"MARGOLUS":"CELLULAR", _update_time);
+			}
+
+			g->SetColor(0xffffffff);
+			g->DrawString(tmp, {BUTTON_GAP, BUTTON_GAP, size.x/2, BUTTON_SIZE}, jcanvas::jhorizontal_align_t::Left);
+
+			if (_capture != nullptr) {
+				snprintf(tmp, sizeof(tmp), "CAPTURE %llu frames %llu dropped", 
+            (unsigned long long)_capture->GetWritten(), (unsigned long long)_capture->GetDropped());
+
+				g->DrawString(tmp, {BUTTON_GAP, BUTTON_GAP + BUTTON_SIZE, size.x/2, BUTTON_SIZE}, jcanvas::jhorizontal_align_t::Left);
+			}
+		}
+
 		virtual bool KeyPressed(jcanvas::KeyEvent *event) 
 		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
 			jcanvas::jkeyevent_symbol_t s = event->GetSymbol();
 
 			if (s == jcanvas::jkeyevent_symbol_t::Enter) {
+				BeginEdit();
 				Clear();
+				EndEdit();
 			} else if (s == jcanvas::jkeyevent_symbol_t::CursorLeft) {
 				for (int i = BUTTON_COUNT; i--;) {
 					if (_current_particle == _buttons[i].particleType) {
@@ -1400,8 +5990,6 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 				}
 			}
 
-      jcanvas::jpoint_t<int>
-        size = GetSize();
 			jcanvas::jkeyevent_modifiers_t 
         m = event->GetModifiers();
 
@@ -1451,8 +6039,32 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 				_current_particle = JPT_STEAM;
 			} else if (s == jcanvas::jkeyevent_symbol_t::F4) { // ice
 				_current_particle = JPT_ICE;
+			} else if (s == jcanvas::jkeyevent_symbol_t::F6) { // zoom the overview out
+				if (_overview_level < MIP_LEVELS) {
+					if (_overview_level++ == 0) {
+						UpdateOverview(true);
+					}
+				}
+			} else if (s == jcanvas::jkeyevent_symbol_t::F7) { // zoom the overview in, down to hiding it
+				if (_overview_level > 0) {
+					_overview_level--;
+				}
+			} else if (s == jcanvas::jkeyevent_symbol_t::PageUp) { // pan the overview
+				_overview_y = std::max(0, _overview_y - ((OVERVIEW_HEIGHT/2) << _overview_level));
+			} else if (s == jcanvas::jkeyevent_symbol_t::PageDown) {
+				_overview_y = std::min(size.y - DASHBOARD_SIZE - 1, _overview_y + ((OVERVIEW_HEIGHT/2) << _overview_level));
+			} else if (s == jcanvas::jkeyevent_symbol_t::Home) {
+				_overview_x = std::max(0, _overview_x - ((OVERVIEW_WIDTH/2) << _overview_level));
+			} else if (s == jcanvas::jkeyevent_symbol_t::End) {
+				_overview_x = std::min(size.x - 1, _overview_x + ((OVERVIEW_WIDTH/2) << _overview_level));
+#ifdef JSAND_REACTION_COUNTERS
+			} else if (s == jcanvas::jkeyevent_symbol_t::F5) { // reactions
+				_reaction_panel ^= true;
+#endif
 			} else if (s == jcanvas::jkeyevent_symbol_t::Delete) { // clear screen
+				BeginEdit();
 				Clear();
+				EndEdit();
 			} else if (s == jcanvas::jkeyevent_symbol_t::v) { // enable or disable oil emitter
 				_emit_oil ^= true;
 			} else if (s == jcanvas::jkeyevent_symbol_t::r) { // increase oil emitter density
@@ -1510,11 +6122,52 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 					_sand_density = 0.05f;
 				}
 			} else if (s == jcanvas::jkeyevent_symbol_t::t) { // draw a bunch of random lines
+				BeginEdit();
 				DoRandomLines(JPT_WALL);
+				EndEdit();
 			} else if (s == jcanvas::jkeyevent_symbol_t::y) { // erase a bunch of random lines
+				BeginEdit();
 				DoRandomLines(JPT_NOTHING);
+				EndEdit();
+			} else if (s == jcanvas::jkeyevent_symbol_t::u) { // undo the last edit
+				Undo();
+			} else if (s == jcanvas::jkeyevent_symbol_t::i) { // redo the last undone edit
+				Redo();
 			} else if (s == jcanvas::jkeyevent_symbol_t::o) { // enable or disable particle swaps
 				_implement_particle_swaps ^= true;
+			} else if (s == jcanvas::jkeyevent_symbol_t::l) { // enable or disable the levelling of liquid surfaces
+				_level_liquids ^= true;
+			} else if (s == jcanvas::jkeyevent_symbol_t::b) { // enable or disable the frame budget of the simulation
+				CloseTick();
+
+				_budget_mode ^= true;
+			} else if (s == jcanvas::jkeyevent_symbol_t::g) { // decrease the target frame time
+				_frame_time = std::max(4.0f, _frame_time - 2.0f);
+			} else if (s == jcanvas::jkeyevent_symbol_t::h) { // increase the target frame time
+				_frame_time = std::min(100.0f, _frame_time + 2.0f);
+			} else if (s == jcanvas::jkeyevent_symbol_t::m) { // switch between the cellular and margolus engines
+				CloseTick();
+
+				_engine = (_engine == JSE_CELLULAR)?JSE_MARGOLUS:JSE_CELLULAR;
+			} else if (s == jcanvas::jkeyevent_symbol_t::j) { // erupt the current particle from the cursor
+				if (_old_y >= 0 && _old_y < size.y - DASHBOARD_SIZE && _old_x >= 0 && _old_x < size.x) {
+					Erupt(_old_x, _old_y, _current_particle);
+				}
+			} else if (s == jcanvas::jkeyevent_symbol_t::n) { // stamp the current prefab at the cursor
+				if (_prefabs.empty() == false) {
+					BeginEdit();
+					StampPrefab(_old_x, _old_y, _prefabs[_current_prefab]);
+					EndEdit();
+				}
+			} else if (s == jcanvas::jkeyevent_symbol_t::k) { // select the next prefab
+				if (_prefabs.empty() == false) {
+					_current_prefab = (_current_prefab + 1) % _prefabs.size();
+				}
+			} else if (s == jcanvas::jkeyevent_symbol_t::p) { // enable or disable the overlay of the simulation cost
+				_cost_overlay ^= true;
+
+				std::fill(_cost, _cost + _cost_columns*_cost_rows, 0.0f);
+				std::fill(_cost_ticks, _cost_ticks + _cost_columns*_cost_rows, 0);
 			}
 
 			return true;
@@ -1528,6 +6181,8 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 				_mb_x = 0;
 				_mb_y = 0;
 				_is_button_down = false;
+
+				EndEdit();
       } else if (!jcanvas::jenum_t<jcanvas::jkeyevent_modifiers_t>{m}.And(jcanvas::jkeyevent_modifiers_t::Alt)) { 
 				_slow = false;
 			}
@@ -1547,6 +6202,8 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 			_mb_x = location.x;
 			_mb_y = location.y;
 
+			BeginEdit();
+
 			if (_mb_x < (size.y-DASHBOARD_SIZE)) {
 				DrawLine(_mb_x, _mb_y, _old_x, _old_y);
 			}
@@ -1571,6 +6228,9 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 			_mb_y = 0;
 			_is_button_down = false;
 
+			// a stroke is a single edit, from the press to the release of the button
+			EndEdit();
+
 			return true;
 		}
 
@@ -1597,6 +6257,9 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 
 		virtual void Paint(jcanvas::Graphics *g) 
 		{
+			std::chrono::steady_clock::time_point 
+        paint_start = std::chrono::steady_clock::now();
+
 			jcanvas::Window::Paint(g);
 
       jcanvas::jpoint_t<int>
@@ -1631,6 +6294,73 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 				_old_y = size.y;
 			}
 
+			//If the button is pressed (and no event has occured since last frame due
+			// to the polling procedure, then draw at the position (enabeling 'dynamic emitters')
+			if (_is_button_down == true) {
+				DrawLine(_old_x, _old_y, _old_x, _old_y);
+			}
+
+			Simulate();
+
+			// Map the virtual screen to the real screen. Only the damaged granules are rendered to the
+			// pixel buffer, which is then copied at once. The flickering networks need the whole
+			// screen, as well as the frame after them
+			bool sparks = IsSparkAlive();
+
+			if (sparks == true || _sparks_drawn == true) {
+				DamageAll();
+			}
+
+			_sparks_drawn = sparks;
+
+			RenderDamage(sparks);
+			RenderFastParticles();
+
+			g->SetRGBArray(_pixels, {0, 0, size.x, size.y - DASHBOARD_SIZE});
+
+			if (_overview_level > 0) {
+				UpdateOverview(false);
+				drawOverview(g);
+			}
+
+			if (_cost_overlay == true) {
+				AccumulateCost();
+				drawCostOverlay(g);
+			}
+
+			Export();
+
+			// Update dashboard
+			DrawDashboard(g);
+
+			drawStatistics(g);
+
+#ifdef JSAND_REACTION_COUNTERS
+			if (_reaction_panel == true) {
+				drawReactions(g);
+			}
+#endif
+
+			drawCursor(g, _old_x, _old_y);
+
+			_paint_time = 0.9f*_paint_time + 0.1f*std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - paint_start).count();
+		}
+
+		// Running a tick of the world: the commands of the control clients, the emitters, the drains
+		// and the particle logic. While paused only the commands run, unless a client asked for steps
+		void Simulate()
+		{
+      jcanvas::jpoint_t<int>
+        size = GetSize();
+
+			if (_control != nullptr) {
+				ServeControl();
+			}
+
+			if (_paused == true && _steps == 0) {
+				return;
+			}
+
 			//To emit or not to emit
 			if (_emit_water) {
 				Emit((size.x/2 - ((size.x/6)*2)), 20, JPT_WATER, _water_density);
@@ -1648,96 +6378,93 @@ class Screen : public jcanvas::Window, public jcanvas::KeyListener, public jcanv
 				Emit((size.x/2 + ((size.x/6)*2)), 20, JPT_OIL, _oil_density);
 			}
 
-			//If the button is pressed (and no event has occured since last frame due
-			// to the polling procedure, then draw at the position (enabeling 'dynamic emitters')
-			if (_is_button_down == true) {
-				DrawLine(_old_x, _old_y, _old_x, _old_y);
-			}
-
-			//Clear bottom line
-			for (int i=0; i<size.x; i++) {
-				_vs[i + ((size.y - DASHBOARD_SIZE - 1)*size.x)] = JPT_NOTHING;
-			}
-
-			//Clear top line
+			// The top and bottom lines are drains, the particles that reach them leave the screen
 			for (int i=0; i<size.x; i++) {
-				_vs[i+((0)*size.x)] = JPT_NOTHING;
+				SetParticle(Index(i, size.y - DASHBOARD_SIZE - 1), JPT_NOTHING);
+				SetParticle(Index(i, 0), JPT_NOTHING);
 			}
 
 			// Update the virtual screen (performing particle logic)
-			UpdateVirtualScreen();
+			std::chrono::steady_clock::time_point 
+        start = std::chrono::steady_clock::now();
 
-			// Map the virtual screen to the real screen
-			_particle_count = 0;
+			UpdateVirtualScreen();
 
-			for (int y=size.y-DASHBOARD_SIZE; y--;) {
-				for (int x=size.x; x--;) {
-					int index = x + (size.x*y);
-					jparticle_type_t same = _vs[index];
+			_update_time = 0.9f*_update_time + 0.1f*std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-					if (same != JPT_NOTHING) {
-						if (IsStillborn(same)) {
-							g->SetRGB(colors[same], {x, y});
-						} else {
-							_particle_count++;
-							if (same % 2 == 1) { // Moved 
-								g->SetRGB(colors[(same-1)], {x, y});
-								_vs[index] = (jparticle_type_t)(same-1); // Set it to not moved
-							} else { // Not moved
-								g->SetRGB(colors[same], {x, y});
-							}
-						}
+			if (_control != nullptr) {
+				// a step is a whole tick, the budget of the simulation can leave one half done
+				if (_steps > 0 && _tick_open == false && --_steps == 0) {
+					for (int client : _step_clients) {
+						_control->Reply(client, JCO_STEP, &_tick, sizeof(_tick));
 					}
+
+					_step_clients.clear();
 				}
+
+				StreamFrames();
 			}
+		}
 
-			// Update dashboard
-			jcanvas::jrect_t<int> dashboard;
+		// Handing the grid to the readers of the shared memory, the capture and the checkpoints
+		void Export()
+		{
+			if (_shared != nullptr) {
+				PublishShared();
+			}
 
-			dashboard = {
-        .point = {
-          .x = 0,
-			    .y = size.y - DASHBOARD_SIZE
-        },
-        .size = {
-			    .x = size.x,
-			    .y = DASHBOARD_SIZE
-        }
-      };
+			if (_capture != nullptr && _tick >= _next_capture) {
+				CaptureFrame();
+			}
 
-			FillRect(g, dashboard, 0xff9b9b9b);
-
-			FillRect(g, _buttons[0].rect, colors[JPT_WATER]);
-			FillRect(g, _buttons[1].rect, colors[JPT_SAND]);
-			FillRect(g, _buttons[2].rect, colors[JPT_SALT]);
-			FillRect(g, _buttons[3].rect, colors[JPT_OIL]);
-			FillRect(g, _buttons[4].rect, colors[JPT_FIRE]);
-			FillRect(g, _buttons[5].rect, colors[JPT_ACID]);
-			FillRect(g, _buttons[6].rect, colors[JPT_DIRT]);
-			FillRect(g, _buttons[7].rect, colors[JPT_WATERSPOUT]);
-			FillRect(g, _buttons[8].rect, colors[JPT_SANDSPOUT]);
-			FillRect(g, _buttons[9].rect, colors[JPT_SALTSPOUT]);
-			FillRect(g, _buttons[10].rect, colors[JPT_OILSPOUT]);
-			FillRect(g, _buttons[11].rect, colors[JPT_WALL]);
-			FillRect(g, _buttons[12].rect, colors[JPT_TORCH]);
-			FillRect(g, _buttons[13].rect, colors[JPT_STOVE]);
-			FillRect(g, _buttons[14].rect, colors[JPT_PLANT]);
-			FillRect(g, _buttons[15].rect, colors[JPT_ICE]);
-			FillRect(g, _buttons[16].rect, colors[JPT_IRONWALL]);
-			FillRect(g, _buttons[17].rect, colors[JPT_VOID]);
-			FillRect(g, _buttons[18].rect, 0);
-
-			drawSelection(g);
-			drawPenSize(g);
-			drawCursor(g, _old_x, _old_y);
+			// the budget of the simulation can leave a tick half done at the end of a frame
+			if (_checkpoint != nullptr && _tick >= _next_checkpoint && _tick_open == false) {
+				SaveCheckpoint();
+			}
+		}
+
+		// Running the simulation without a window, driven by the control clients, until SIGINT or
+		// SIGTERM. Nothing renders the grid, so the moved flags are reset after every tick
+		void RunHeadless()
+		{
+			while (headless_stop == 0) {
+				if (_paused == true && _steps == 0) {
+					_control->Wait(std::chrono::milliseconds(100));
+				}
+
+				uint64_t tick = _tick;
+
+				Simulate();
+
+				if (_tick != tick) {
+					ResetMovedFlags();
+				}
+
+				Export();
+			}
 		}
 
 		virtual void ShowApp() 
     {
+      std::chrono::steady_clock::time_point
+        deadline = std::chrono::steady_clock::now();
+
       do {
         Repaint();
-        
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        // pace the frames against a deadline instead of sleeping a fixed time after each one, so the
+        // frame rate doesn't depend on how long the frame took. A late frame moves the deadline
+        // instead of bursting frames to catch up
+        deadline += std::chrono::microseconds((int)(_frame_time*1000.0f));
+
+        std::chrono::steady_clock::time_point
+          now = std::chrono::steady_clock::now();
+
+        if (deadline < now) {
+          deadline = now;
+        }
+
+        std::this_thread::sleep_until(deadline);
       } while (IsVisible() == true);
     }
 
@@ -1747,9 +6474,142 @@ int main(int argc, char **argv)
 {
 	jcanvas::Application::Init(argc, argv);
 
+	// --isa <generic|avx2|avx512>: forces the variant of the kernels instead of the best one the cpu
+	// supports. It's read before anything else, since the kernels are chosen once
+	for (int i=1; i<argc-1; i++) {
+		if (strcmp(argv[i], "--isa") == 0) {
+			kernels = SelectKernels(argv[i + 1]);
+
+			if (kernels == nullptr) {
+				fprintf(stderr, "isa: %s is unknown or not supported by this cpu\n", argv[i + 1]);
+
+				return 1;
+			}
+		}
+	}
+
+	// --benchmark [width height ticks] [--isa name]: times the simulation without a window
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+		int values[3] = {3840, 1024, 100};
+
+		for (int i=2, n=0; i<argc && n<3; i++) {
+			if (strcmp(argv[i], "--isa") == 0) {
+				i++;
+			} else {
+				values[n++] = atoi(argv[i]);
+			}
+		}
+
+		int width = values[0];
+		int height = values[1];
+		int ticks = values[2];
+
+		if (width <= 0 || height <= 0) {
+			fprintf(stderr, "usage: %s --benchmark [width height ticks] [--isa name]\n", argv[0]);
+
+			return 1;
+		}
+
+		Screen benchmark({width, height + DASHBOARD_SIZE});
+
+		benchmark.Benchmark(ticks);
+
+		return 0;
+	}
+
 	Screen app;
+	uint64_t seed = time(NULL);
+	bool headless = false;
+
+	// --shm [name]: exports the grid in a shared memory segment, see jsandplus-reader
+	// --capture <directory|file.y4m> [interval]: records the screen every 'interval' ticks
+	// --checkpoint <directory> [interval]: saves the grid every 'interval' ticks
+	// --resume <file>: starts from a checkpoint
+	// --seed <number>: seeds the simulation instead of the clock
+	// --control [path]: serves the control protocol on a Unix domain socket, see jsandplus.h
+	// --headless: runs without a window, driven by the control clients
+	// --prefab <file.ppm>: loads a prefab to be stamped with 'n' ('k' selects the next one)
+	// --reactions <file.csv>: streams the reactions of every tick (built with JSAND_REACTION_COUNTERS)
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "--shm") == 0) {
+			std::string name = SHARED_GRID_NAME;
+
+			if (i + 1 < argc && argv[i + 1][0] == '/') {
+				name = argv[++i];
+			}
+
+			if (app.ExportShared(name) == false) {
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+			std::string target = argv[++i];
+			int interval = 1;
+
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+				interval = atoi(argv[++i]);
+			}
+
+			if (app.StartCapture(target, interval) == false) {
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+			std::string directory = argv[++i];
+			int interval = CHECKPOINT_INTERVAL;
+
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+				interval = atoi(argv[++i]);
+			}
+
+			if (app.StartCheckpoints(directory, interval) == false) {
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--control") == 0) {
+			std::string path = CONTROL_SOCKET_PATH;
+
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				path = argv[++i];
+			}
+
+			if (app.StartControl(path) == false) {
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--prefab") == 0 && i + 1 < argc) {
+			if (app.LoadPrefab(argv[++i]) == false) {
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--headless") == 0) {
+			headless = true;
+		} else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = strtoull(argv[++i], nullptr, 0);
+		} else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+			if (app.Resume(argv[++i]) == false) {
+				return 1;
+			}
+#ifdef JSAND_REACTION_COUNTERS
+		} else if (strcmp(argv[i], "--reactions") == 0 && i + 1 < argc) {
+			if (app.StartReactions(argv[++i]) == false) {
+				return 1;
+			}
+#endif
+		}
+	}
+
+	srand(seed);
+
+	app.SetSeed(seed);
+
+	if (headless == true) {
+		if (app.IsControlled() == false && app.StartControl(CONTROL_SOCKET_PATH) == false) {
+			return 1;
+		}
+
+		signal(SIGINT, [](int) { headless_stop = 1; });
+		signal(SIGTERM, [](int) { headless_stop = 1; });
+
+		app.RunHeadless();
 
-	srand(time(NULL));
+		return 0;
+	}
 
 	app.SetTitle("Ball Drop");
 	app.SetVisible(true);
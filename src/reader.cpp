@@ -0,0 +1,133 @@
+/**
+ * Reference reader of the grid exported by 'jsandplus --shm'. It maps the segment read-only and
+ * prints the number of cells of each material, without copying the cells.
+ *
+ */
+#include "jsandplus.h"
+
+#include <chrono>
+#include <thread>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Counting the cells of a published frame. The counts are discarded and taken again when the
+// simulator published a new frame meanwhile
+uint64_t CountParticles(const jshared_grid_t *grid, uint64_t counts[PARTICLETYPE_ENUM_LENGTH])
+{
+	const int32_t
+    *cells = (const int32_t *)(grid + 1);
+	int
+    length = grid->width*grid->height;
+
+	for (;;) {
+		uint64_t sequence = grid->sequence.load(std::memory_order_acquire);
+
+		if ((sequence & 1) != 0) {
+			std::this_thread::yield();
+
+			continue;
+		}
+
+		memset(counts, 0, PARTICLETYPE_ENUM_LENGTH*sizeof(uint64_t));
+
+		for (int i=0; i<length; i++) {
+			int32_t type = cells[i];
+
+			if (type >= 0 && type < PARTICLETYPE_ENUM_LENGTH) {
+				counts[type]++;
+			}
+		}
+
+		uint64_t tick = grid->tick;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (grid->sequence.load(std::memory_order_relaxed) == sequence) {
+			return tick;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char
+    *name = (argc > 1)?argv[1]:SHARED_GRID_NAME;
+	int
+    samples = (argc > 2)?atoi(argv[2]):1;
+	int
+    fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0) {
+		perror("shm_open");
+
+		return 1;
+	}
+
+	struct stat info;
+
+	if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(jshared_grid_t)) {
+		fprintf(stderr, "%s: not a jsandplus grid\n", name);
+		close(fd);
+
+		return 1;
+	}
+
+	void *address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (address == MAP_FAILED) {
+		perror("mmap");
+
+		return 1;
+	}
+
+	const jshared_grid_t
+    *grid = (const jshared_grid_t *)address;
+
+	if (grid->magic != SHARED_GRID_MAGIC || grid->version != SHARED_GRID_VERSION ||
+      sizeof(jshared_grid_t) + (size_t)grid->width*grid->height*sizeof(int32_t) > (size_t)info.st_size) {
+		fprintf(stderr, "%s: not a jsandplus grid\n", name);
+		munmap(address, info.st_size);
+
+		return 1;
+	}
+
+	for (int i=0; i<samples; i++) {
+		uint64_t counts[PARTICLETYPE_ENUM_LENGTH];
+
+		if (i > 0) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+
+		uint64_t tick = CountParticles(grid, counts);
+
+		printf("tick %llu, %dx%d cells\n", (unsigned long long)tick, grid->width, grid->height);
+
+		// the moved variants are counted with their particle
+		for (int t=0; t<PARTICLETYPE_ENUM_LENGTH; t++) {
+			uint64_t count = counts[t];
+
+			if (t >= JPT_WATER && (t % 2) == 0) {
+				count = count + counts[t + 1];
+			} else if (t >= JPT_WATER) {
+				continue;
+			}
+
+			if (count > 0 && t != JPT_NOTHING) {
+				printf("  %-16s %llu\n", GetParticleName((jparticle_type_t)t).c_str(), (unsigned long long)count);
+			}
+		}
+	}
+
+	munmap(address, info.st_size);
+
+	return 0;
+}